@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Markers for the simulator benchmark (make bench). When built with -DBENCH,
+ * cec_tv_periodic() writes BENCH_ENTER to GPIOR2 on entry and a branch
+ * number after each event it handles. bench/avr_bench.c charges the cycles
+ * since the previous marker to that branch, BENCH_IDLE is the final round
+ * that found nothing to do. Each marker is an ldi/out pair, two cycles.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+enum bench_branch {
+	BENCH_IDLE,
+	BENCH_TX_DONE,
+	BENCH_SERIAL_RESP,
+	BENCH_SERIAL_RX,
+	BENCH_IR,
+	BENCH_CEC_RX,
+	BENCH_SERIAL_TX,
+	BENCH_CEC_TX,
+	BENCH_NR_BRANCHES,
+	BENCH_ENTER = 0xff,
+};
+
+#ifdef BENCH
+#define BENCH_MARK(n)	(GPIOR2 = (n))
+#else
+#define BENCH_MARK(n)	do {} while (0)
+#endif
+
+#endif
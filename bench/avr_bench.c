@@ -0,0 +1,496 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cycle counts for the firmware under simavr.
+ *
+ * avr_bench <elf> <nm output>
+ *
+ * Runs bench.elf (main.c built with -DBENCH) one instruction at a time
+ * while feeding it NEC remote presses on INT0 (PB2), TV replies as 9600
+ * baud serial on the USI DI pin (PB0) and CEC frames on PB3. simavr has no
+ * USI for the tiny45 so a minimal one is modelled here, a 4 bit counter
+ * clocked by Timer0 compare match that shifts in DI and raises the overflow
+ * interrupt.
+ *
+ * Interrupts are timed from their vector table slot to the reti, functions
+ * from their entry to the ret. Time spent in nested interrupts is only
+ * charged to the interrupt. cec_tv_periodic() events are timed between
+ * the BENCH_MARK() writes to GPIOR2, see bench.h. The main loop is timed
+ * between successive calls to jiffies32().
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/sim_interrupts.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_ioport.h>
+
+#include "bench.h"
+
+/* ATtiny45 data space addresses */
+#define USICR		0x2d
+#define USISR		0x2e
+#define USIDR		0x2f
+#define USIBR		0x30
+#define GPIOR2		0x35
+#define OCR0A		0x49
+#define TCCR0B		0x53
+
+#define USIOIE		6
+#define USIOIF		6
+#define USIOIF_MASK	(1 << USIOIF)
+#define USICNT_MASK	0x0f
+
+#define VECTOR_INT0	1
+#define VECTOR_USI_OVF	14
+#define VECTOR_SIZE	2
+
+/* Simulated time to run for */
+#define BENCH_SECONDS	10
+
+/* CEC receivers have 200us of slop on each bit */
+#define CEC_MARGIN_US	200
+
+enum {
+	STAT_VECTOR_1,
+	STAT_VECTOR_14,
+	STAT_JIFFIES,
+	STAT_LOOP,
+	STAT_BRANCH,
+	NR_STATS = STAT_BRANCH + BENCH_NR_BRANCHES,
+};
+
+static const char *stat_names[NR_STATS] = {
+	[STAT_VECTOR_1] = "__vector_1",
+	[STAT_VECTOR_14] = "__vector_14",
+	[STAT_JIFFIES] = "jiffies32",
+	[STAT_LOOP] = "main loop",
+	[STAT_BRANCH + BENCH_IDLE] = "cec_tv_periodic idle",
+	[STAT_BRANCH + BENCH_TX_DONE] = "cec_tv_periodic tx done",
+	[STAT_BRANCH + BENCH_SERIAL_RESP] = "cec_tv_periodic serial resp",
+	[STAT_BRANCH + BENCH_SERIAL_RX] = "cec_tv_periodic serial rx",
+	[STAT_BRANCH + BENCH_IR] = "cec_tv_periodic ir",
+	[STAT_BRANCH + BENCH_CEC_RX] = "cec_tv_periodic cec rx",
+	[STAT_BRANCH + BENCH_SERIAL_TX] = "cec_tv_periodic serial tx",
+	[STAT_BRANCH + BENCH_CEC_TX] = "cec_tv_periodic cec tx",
+};
+
+struct stat {
+	unsigned long count;
+	unsigned long long total;
+	unsigned long min;
+	unsigned long max;
+};
+
+static struct stat stats[NR_STATS];
+
+static void stat_add(unsigned char n, unsigned long cycles)
+{
+	struct stat *s = stats + n;
+
+	if (!s->count || cycles < s->min)
+		s->min = cycles;
+	if (cycles > s->max)
+		s->max = cycles;
+	s->total += cycles;
+	s->count++;
+}
+
+/* Calls and interrupts in progress */
+struct frame {
+	unsigned char stat;
+	bool isr;
+	uint16_t sp;
+	avr_cycle_count_t start;
+	avr_cycle_count_t nested;
+};
+
+static struct frame frames[8];
+static unsigned char nframes;
+
+/* Cycles spent in completed interrupts, for subtracting from callers */
+static avr_cycle_count_t isr_cycles;
+
+static avr_cycle_count_t loop_start;
+static avr_cycle_count_t branch_start;
+static avr_cycle_count_t branch_nested;
+
+static uint32_t sym_jiffies;
+
+static uint16_t sp_get(avr_t *avr)
+{
+	return avr->data[R_SPL] | avr->data[R_SPH] << 8;
+}
+
+static void frame_push(avr_t *avr, unsigned char stat, bool isr)
+{
+	struct frame *f;
+
+	if (nframes == sizeof(frames) / sizeof(*frames))
+		return;
+
+	f = frames + nframes++;
+	f->stat = stat;
+	f->isr = isr;
+	f->sp = sp_get(avr);
+	f->start = avr->cycle;
+	f->nested = isr_cycles;
+}
+
+/* Called after every instruction */
+static void trace(avr_t *avr)
+{
+	struct frame *f;
+	unsigned long cycles;
+
+	/* Returned from something? */
+	while (nframes && sp_get(avr) > frames[nframes - 1].sp) {
+		f = frames + --nframes;
+		cycles = avr->cycle - f->start - (isr_cycles - f->nested);
+		stat_add(f->stat, cycles);
+		if (f->isr)
+			isr_cycles += cycles;
+	}
+
+	if (avr->pc == VECTOR_INT0 * VECTOR_SIZE)
+		frame_push(avr, STAT_VECTOR_1, true);
+	else if (avr->pc == VECTOR_USI_OVF * VECTOR_SIZE)
+		frame_push(avr, STAT_VECTOR_14, true);
+	else if (avr->pc == sym_jiffies) {
+		frame_push(avr, STAT_JIFFIES, false);
+		if (loop_start)
+			stat_add(STAT_LOOP, avr->cycle - loop_start);
+		loop_start = avr->cycle;
+	}
+}
+
+static void gpior2_write(avr_t *avr, avr_io_addr_t addr, uint8_t v,
+								void *param)
+{
+	avr->data[addr] = v;
+
+	if (v == BENCH_ENTER) {
+		branch_start = avr->cycle;
+		branch_nested = isr_cycles;
+	} else if (v < BENCH_NR_BRANCHES && branch_start) {
+		stat_add(STAT_BRANCH + v, avr->cycle - branch_start -
+						(isr_cycles - branch_nested));
+		/* The next event is timed from here */
+		branch_start = v == BENCH_IDLE ? 0 : avr->cycle;
+		branch_nested = isr_cycles;
+	}
+}
+
+/*
+ * USI, three wire mode clocked from Timer0 compare match. The firmware
+ * only uses it as a sampler, DO isn't modelled.
+ */
+static avr_int_vector_t usi_ovf = {
+	.enable = AVR_IO_REGBIT(USICR, USIOIE),
+	.raised = AVR_IO_REGBIT(USISR, USIOIF),
+	.vector = VECTOR_USI_OVF,
+};
+
+static avr_irq_t *usi_di;
+
+static void usi_usisr_write(avr_t *avr, avr_io_addr_t addr, uint8_t v,
+								void *param)
+{
+	/* Flags are cleared by writing one */
+	avr->data[addr] = (avr->data[addr] & ~v & ~USICNT_MASK) |
+							(v & USICNT_MASK);
+	if (v & USIOIF_MASK)
+		avr_clear_interrupt(avr, &usi_ovf);
+}
+
+static avr_cycle_count_t usi_clock(avr_t *avr, avr_cycle_count_t when,
+								void *param)
+{
+	uint8_t cnt;
+
+	/* Timer0 stopped */
+	if (!(avr->data[TCCR0B] & 7))
+		return when + 8 * 256;
+
+	avr->data[USIDR] = avr->data[USIDR] << 1 | (usi_di->value & 1);
+
+	cnt = (avr->data[USISR] + 1) & USICNT_MASK;
+	avr->data[USISR] = (avr->data[USISR] & ~USICNT_MASK) | cnt;
+	if (!cnt) {
+		avr->data[USIBR] = avr->data[USIDR];
+		avr->data[USISR] |= USIOIF_MASK;
+		avr_raise_interrupt(avr, &usi_ovf);
+	}
+
+	/* CTC mode, prescaler of 8 */
+	return when + 8 * (avr->data[OCR0A] + 1);
+}
+
+/* Waveforms, each edge holds a level for some microseconds */
+struct edge {
+	uint32_t us;
+	uint8_t level;
+};
+
+struct wave {
+	avr_irq_t *irq;
+	bool running;
+	unsigned int head;
+	unsigned int tail;
+	struct edge edges[4096];
+};
+
+#define WAVE_SIZE	(sizeof(((struct wave *) 0)->edges) / sizeof(struct edge))
+
+static struct wave ir_wave, ser_wave, cec_wave;
+
+static avr_cycle_count_t wave_next(avr_t *avr, avr_cycle_count_t when,
+								void *param)
+{
+	struct wave *w = param;
+	struct edge *e;
+
+	if (w->head == w->tail) {
+		/* Everything idles high */
+		avr_raise_irq(w->irq, 1);
+		w->running = false;
+		return 0;
+	}
+
+	e = w->edges + w->tail++ % WAVE_SIZE;
+	avr_raise_irq(w->irq, e->level);
+	return when + avr_usec_to_cycles(avr, e->us);
+}
+
+static void wave_add(struct wave *w, uint8_t level, uint32_t us)
+{
+	struct edge *e;
+
+	if (w->head - w->tail == WAVE_SIZE)
+		return;
+
+	e = w->edges + w->head++ % WAVE_SIZE;
+	e->level = level;
+	e->us = us;
+}
+
+static void wave_start(avr_t *avr, struct wave *w)
+{
+	if (!w->running && w->head != w->tail) {
+		w->running = true;
+		avr_cycle_timer_register(avr, 1, wave_next, w);
+	}
+}
+
+/* NEC remote, marks are low */
+static void ir_press(uint8_t address, uint8_t code, unsigned char repeats)
+{
+	uint32_t data;
+	unsigned char i;
+
+	data = address | (address ^ 0xff) << 8 | code << 16 |
+						(uint32_t) (code ^ 0xff) << 24;
+
+	wave_add(&ir_wave, 0, 9000);
+	wave_add(&ir_wave, 1, 4500);
+	for (i = 0; i < 32; i++, data >>= 1) {
+		wave_add(&ir_wave, 0, 560);
+		wave_add(&ir_wave, 1, data & 1 ? 1690 : 560);
+	}
+	wave_add(&ir_wave, 0, 560);
+	wave_add(&ir_wave, 1, 108000 - 67500);
+
+	while (repeats--) {
+		wave_add(&ir_wave, 0, 9000);
+		wave_add(&ir_wave, 1, 2250);
+		wave_add(&ir_wave, 0, 560);
+		wave_add(&ir_wave, 1, 108000 - 11810);
+	}
+}
+
+/* 9600 8N1 */
+static void ser_send(const char *str)
+{
+	unsigned char i;
+	uint8_t c;
+
+	while ((c = *str++)) {
+		wave_add(&ser_wave, 0, 104);
+		for (i = 0; i < 8; i++, c >>= 1)
+			wave_add(&ser_wave, c & 1, 104);
+		wave_add(&ser_wave, 1, 104);
+	}
+}
+
+static void cec_bit(bool one)
+{
+	wave_add(&cec_wave, 0, one ? 600 : 1500);
+	wave_add(&cec_wave, 1, one ? 1800 : 900);
+}
+
+/* A CEC frame from another device, nobody drives the ack */
+static void cec_send(const uint8_t *buf, unsigned char len)
+{
+	unsigned char i, j;
+
+	wave_add(&cec_wave, 0, 3700);
+	wave_add(&cec_wave, 1, 800);
+	for (i = 0; i < len; i++) {
+		for (j = 0; j < 8; j++)
+			cec_bit(buf[i] & (0x80 >> j));
+		cec_bit(i == len - 1);
+		cec_bit(true);
+	}
+	/* Signal free time */
+	wave_add(&cec_wave, 1, 7 * 2400);
+}
+
+/* Every quarter second, some of everything */
+static avr_cycle_count_t stimulus(avr_t *avr, avr_cycle_count_t when,
+								void *param)
+{
+	static const uint8_t frames[][4] = {
+		{ 0x4f, 0x82, 0x10, 0x00 },	/* Active source 1.0.0.0 */
+		{ 0x40, 0x8f },			/* Give power status */
+		{ 0x8f, 0x82, 0x20, 0x00 },	/* Active source 2.0.0.0 */
+		{ 0x40, 0x9f },			/* Get CEC version */
+	};
+	static unsigned int round;
+
+	ir_press(4, round & 1 ? 0x02 : 0x03, 1);
+	ser_send(round & 1 ? "a 01 OK01x" : "m 01 OK00x");
+	cec_send(frames[round % 4], round & 1 ? 2 : 4);
+	round++;
+
+	wave_start(avr, &ir_wave);
+	wave_start(avr, &ser_wave);
+	wave_start(avr, &cec_wave);
+
+	return when + avr_usec_to_cycles(avr, 250000);
+}
+
+static uint32_t sym_lookup(const char *file, const char *name)
+{
+	char line[256], sym[128];
+	unsigned long addr;
+	char type;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f) {
+		perror(file);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx %c %127s", &addr, &type, sym) == 3 &&
+							!strcmp(sym, name)) {
+			fclose(f);
+			return addr;
+		}
+	}
+
+	fprintf(stderr, "%s: no symbol %s\n", file, name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	elf_firmware_t fw;
+	avr_cycle_count_t end;
+	unsigned long max_isr;
+	avr_t *avr;
+	unsigned char i;
+	int state;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <elf> <nm output>\n", argv[0]);
+		return 1;
+	}
+
+	memset(&fw, 0, sizeof(fw));
+	if (elf_read_firmware(argv[1], &fw)) {
+		fprintf(stderr, "%s: could not load\n", argv[1]);
+		return 1;
+	}
+	sym_jiffies = sym_lookup(argv[2], "jiffies32");
+
+	avr = avr_make_mcu_by_name("attiny45");
+	if (!avr)
+		return 1;
+	avr_init(avr);
+	avr->frequency = F_CPU;
+	avr_load_firmware(avr, &fw);
+
+	avr_register_vector(avr, &usi_ovf);
+	avr_register_io_write(avr, USISR, usi_usisr_write, NULL);
+	avr_register_io_write(avr, GPIOR2, gpior2_write, NULL);
+
+	usi_di = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0);
+	ir_wave.irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2);
+	ser_wave.irq = usi_di;
+	cec_wave.irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 3);
+	avr_raise_irq(ir_wave.irq, 1);
+	avr_raise_irq(ser_wave.irq, 1);
+	avr_raise_irq(cec_wave.irq, 1);
+
+	avr_cycle_timer_register(avr, 8 * 256, usi_clock, NULL);
+	/* Let it boot and settle before the first round */
+	avr_cycle_timer_register_usec(avr, 100000, stimulus, NULL);
+
+	end = avr_usec_to_cycles(avr, BENCH_SECONDS * 1000000UL);
+	do {
+		state = avr_run(avr);
+		trace(avr);
+	} while (avr->cycle < end && state != cpu_Done &&
+						state != cpu_Crashed);
+
+	if (state == cpu_Crashed) {
+		fprintf(stderr, "Crashed at 0x%04x\n", avr->pc);
+		return 1;
+	}
+
+	printf("%-28s %8s %6s %8s %6s %9s\n", "", "count", "min", "avg",
+							"max", "max us");
+	for (i = 0; i < NR_STATS; i++) {
+		struct stat *s = stats + i;
+
+		if (!s->count)
+			continue;
+		printf("%-28s %8lu %6lu %8.1f %6lu %9.1f\n", stat_names[i],
+			s->count, s->min, (double) s->total / s->count, s->max,
+			s->max * 1e6 / F_CPU);
+	}
+
+	/* Worst case, both interrupts back to back at the wrong moment */
+	max_isr = stats[STAT_VECTOR_1].max + stats[STAT_VECTOR_14].max;
+	printf("\nWorst case interrupt latency %lu cycles, %.1f of %u us "
+		"CEC bit margin\n", max_isr, max_isr * 1e6 / F_CPU,
+		CEC_MARGIN_US);
+	printf("Worst case main loop %lu cycles, %.1f of %u us\n",
+		stats[STAT_LOOP].max, stats[STAT_LOOP].max * 1e6 / F_CPU,
+		CEC_MARGIN_US);
+
+	return 0;
+}
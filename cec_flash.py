@@ -21,6 +21,11 @@
 # on hexfiles and currently uses a HID based CEC device. It could be
 # easily adapted to the standard Linux kernel interface or other CEC
 # libraries.
+#
+# Bootloaders that take data frames (see cec_bl.S) get each page as a
+# window of 11 byte frames queued without waiting on their acks, then the
+# frame that fills the page on its own. Older ones get 8 byte data writes,
+# one at a time.
 
 import cec
 import cec_msg
@@ -32,14 +37,19 @@ import progress.bar
 
 crc16 = crcmod.mkCrcFun(0x18005, 0xffff)
 
+DATA_OPCODE = 0xa0
+DATA_FRAME = 11
+
 class cec_flasher(cec.device):
     def __init__(self, idx=0):
         super(cec_flasher, self).__init__(idx)
+        self.responses = []
         self.logical_addresses(1 << 0xf)
 	self.read(timeout_ms=1)
 
     def tx_done(self, status):
         self.response = status
+        self.responses.append(status)
 
     def receive_msg(self, msg, length, status):
         extended = []
@@ -81,7 +91,14 @@ class cec_flasher(cec.device):
 
     def erase(self):
         if not self.cmd(3):
-            raise Execption('Erase failed')
+            raise Exception('Erase failed')
+        # The CPU stops for each page it erases, about 265ms for all of
+        # them on an ATtiny45 and 550ms on an ATtiny85, and nothing is
+        # acked until it is done
+        for i in range(20):
+            if self.cmd(0):
+                return
+        raise Exception('No answer after erase')
 
     def write_data(self, b):
         if len(b) != 8:
@@ -93,9 +110,50 @@ class cec_flasher(cec.device):
             retries -= 1
         raise Exception('Write failed')
 
+    def data_frame(self, offset, b):
+        b = struct.pack('<BBB', 0xf0, DATA_OPCODE, offset) + b
+        return b + struct.pack('<H', crc16(b))
+
+    def probe(self):
+        # An empty data frame at the start of the page, older bootloaders
+        # nack the opcode. Falling back is always safe.
+        for i in range(3):
+            if self.write_sync(self.data_frame(0, '')):
+                return True
+        return False
+
+    def write_window(self, frames):
+        retries = 10
+        while frames:
+            self.responses = []
+            for b in frames:
+                self.write(b)
+            while len(self.responses) < len(frames):
+                self.read()
+
+            # An ack means every frame before it went in, even one whose
+            # ack we missed. A resent frame that did go in is acked again.
+            acked = 0
+            for i, status in enumerate(self.responses):
+                if status:
+                    acked = i + 1
+            frames = frames[acked:]
+
+            if not acked:
+                retries -= 1
+                if not retries:
+                    raise Exception('Write failed')
+
+    def write_page(self, page):
+        frames = [self.data_frame(i, page[i:i+DATA_FRAME])
+                  for i in range(0, len(page), DATA_FRAME)]
+        self.write_window(frames[:-1])
+        # The bootloader writes the page once this one is acked
+        self.write_window(frames[-1:])
+
     def run(self):
         if not self.cmd(1):
-            raise Execption('Run failed')
+            raise Exception('Run failed')
 
     def enter(self):
         self.write_sync('\x80\x89\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f\xb1')
@@ -134,8 +192,9 @@ def patch_rjmp(dest, base):
 def patch_jmp(dest):
     return struct.pack('<HH', 0x940c, dest / 2)
 
-# Hardcoded
-bootloader_start = 0xec0
+# BOOTLOADER_ADDRESS from the config the bootloader was built with, the
+# ATtiny85's unless given
+bootloader_start = int(sys.argv[2], 16) if len(sys.argv) > 2 else 0x1ec0
 flash_end = (bootloader_start & ~4095) + 4096
 pagesize = 0x40
 
@@ -154,7 +213,9 @@ dev.enter()
 dev.ping()
 print 'Erasing'
 dev.erase()
-print 'Programming %d bytes' % seg.size
+data_frames = dev.probe()
+print 'Programming %d bytes with %s' % (seg.size,
+        'data frames' if data_frames else '8 byte writes')
 
 bar = progress.bar.Bar('Flashing', max=bootloader_start/pagesize,
 		suffix='Page %(index)d/%(max)d, %(eta)ds')
@@ -168,6 +229,9 @@ for addr, page in zip(range(0, bootloader_start, pagesize), pages(seg.data, page
         page = page [:-4] + patch_jmp(user_reset)
 
     bar.next()
+    if data_frames:
+        dev.write_page(page)
+        continue
     for chunk in [page[i:i+8] for i in range(0, pagesize, 8)]:
         dev.write_data(chunk)
 
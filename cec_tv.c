@@ -16,15 +16,24 @@
  */
 
 #include <stddef.h>
+#include <string.h>
+#include <avr/eeprom.h>
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
-
-#include "avr-cec/time.h"
-#include "avr-cec/cec_msg.h"
-#include "avr-cec/cec.h"
-#include "avr-cec/cec_spec.h"
+#include <util/atomic.h>
+#include <util/crc16.h>
+
+#include "time.h"
+#include "cec_msg.h"
+#include "cec.h"
+#include "cec_spec.h"
+#include "timer.h"
 #include "usi_uart.h"
+#include "lg_serial.h"
 #include "lgtv_keys.h"
+#include "keymap.h"
+#include "diag.h"
+#include "bench.h"
 
 enum tv_state {
 	TV_OFF,
@@ -37,37 +46,115 @@ enum tv_state {
 
 enum new_source_state {
 	NEW_SOURCE_IDLE,
-	NEW_SOURCE_PING,
+	/* Move on to the next source in the device table */
 	NEW_SOURCE_PICK,
-	NEW_SOURCE_LOGICAL,
-	NEW_SOURCE_PHYS,
+	/* Nothing in the table, take the next source that reports in */
+	NEW_SOURCE_WAIT,
+};
+
+enum timers {
+	/* Key repeart timeout, initial repeat 500ms, subsequent 100ms */
+	TIMER_REPEAT,
+
+	/* Controls how often to send serial commands/queries to the TV */
+	TIMER_TV_QUERY,
+
+	/* Time until the next discovery sweep */
+	TIMER_SWEEP,
+
+	/*
+	 * How long to wait for all routing change messages to be received
+	 * before acting on them.
+	 */
+	TIMER_ROUTING_CHANGE,
+
+	/* Discard partial messages from the TV after the serial timeout */
+	TIMER_SERIAL_RX,
+
+	/* Oldest command on the wire has had no reply from the TV */
+	TIMER_LG_REPLY,
+
+	/* Hold off resending to the TV after a failed command */
+	TIMER_LG_RETRY,
+
+	/* Time to bring the EEPROM snapshot up to date */
+	TIMER_PERSIST,
+};
+
+/* Most events handled in one cec_tv_periodic() pass */
+#ifndef CEC_TV_BUDGET
+#define CEC_TV_BUDGET	8
+#endif
+
+enum cec_tv_sources {
+	CEC_TV_SRC_SERIAL_RX,
+	CEC_TV_SRC_IR,
+	CEC_TV_SRC_CEC_RX,
+	CEC_TV_SRC_SERIAL_TX,
+	CEC_TV_SRC_CEC_TX,
+	CEC_TV_NR_SRC,
 };
 
-static signed char timeouts[6];
+#ifdef CEC_TV_STATS
+/* Deepest backlog seen for each source at the start of a pass */
+unsigned char cec_tv_depth[CEC_TV_NR_SRC];
+#define CEC_TV_DEPTH(src, depth) do {				\
+	unsigned char __d = (depth);				\
+	if (__d > cec_tv_depth[src])				\
+		cec_tv_depth[src] = __d;			\
+} while (0)
+#else
+#define CEC_TV_DEPTH(src, depth) do {} while (0)
+#endif
+
+/*
+ * Frames waiting for the CEC bus. The oldest frame of the most urgent
+ * class goes out next.
+ */
+enum cec_tx_class {
+	/* Answers to messages sent to us */
+	CEC_TX_REPLY,
 
-/* Key repeart timeout, initial repeat 500ms, subsequent 100ms */
-#define repeat_timeout		timeouts[0]
+	/* User control press/release, deck control */
+	CEC_TX_UI,
 
-/* Controls how often to send serial commands/queries to the TV */
-#define tv_query_timeout	timeouts[1]
+	/* Active source, set stream path */
+	CEC_TX_ROUTING,
 
-/* New source state machine timeout */
-#define new_source_timeout	timeouts[2]
+	/* Looking for sources */
+	CEC_TX_POLL,
+};
 
 /*
- * How long to wait for all routing change messages to be received before
- * acting on them.
+ * Two sweep polls and room for one more urgent frame; a full queue drops
+ * the least urgent frame for anything more urgent.
  */
-#define routing_change_timeout	timeouts[3]
+#define CEC_TX_QUEUE	3
+
+/* Header, opcode and up to three operands */
+#define CEC_TX_MAX	5
+
+/* Who is told whether a frame was acked once it has been sent */
+enum cec_tx_done {
+	CEC_TX_DONE_NONE,
+
+	/* cec_tv_sweep_done() */
+	CEC_TX_DONE_SWEEP,
+};
 
-/* Discard partial messages from the TV after the serial timeout */
-#define serial_rx_timeout	timeouts[4]
+/* enum cec_tx_class, enum cec_tx_done and length share a byte */
+struct cec_tx {
+	unsigned char class:2;
+	unsigned char done:1;
+	unsigned char len:3;
+	unsigned char buf[CEC_TX_MAX];
+};
 
-#define serial_tx_timeout	timeouts[5]
+static struct cec_tx cec_txq[CEC_TX_QUEUE];
+static unsigned char cec_tx_count;
 
-/* Queue of messages that require direct replies */
-static unsigned char recv_pend_cnt;
-static unsigned char recv_pend[8*2];
+/* The enum cec_tx_done for the frame in transmit_buf */
+static unsigned char cec_tx_done;
 
 /* Remote keycode to send to the TV */
 static unsigned char serial_key_code;
@@ -81,14 +168,56 @@ static unsigned char tv_state;
 /* Bitmap of present CEC addresses */
 static unsigned short source_present;
 
-/* Next source to test */
+/* Bitmap of addresses with an entry in cec_tv_devs */
+static unsigned short source_known;
+
+/*
+ * What we know about the devices we've seen, addresses 1 to 14 only. A
+ * new device takes the place of the one heard from least recently if the
+ * table is full, the active source is never replaced.
+ */
+#define CEC_TV_DEVS		4
+
+struct cec_tv_dev {
+	/* logical << 4 | device type, 0 if the entry is free */
+	unsigned char id;
+	/* CEC_TV_NOW() when we last heard from it */
+	unsigned char seen;
+	unsigned short phys;
+};
+static struct cec_tv_dev cec_tv_devs[CEC_TV_DEVS];
+
+/* Roughly one second per count */
+#define CEC_TV_NOW()		((unsigned char) (timer_ticks() >> 6))
+
+/*
+ * Re-sweep this long after the last one, skipping anyone we've heard
+ * from since.
+ */
+#define CEC_TV_SWEEP_S		30
+
+/* Addresses still to poll in the current sweep, all of them at boot */
+static unsigned short sweep_pending = 0x7ffe;
+
+/*
+ * Addresses that didn't take a sweep poll since the last timed sweep,
+ * sweeps in between leave them alone.
+ */
+static unsigned short sweep_nacked;
+
+/* Last source tried when cycling through the table */
 static unsigned char next_source;
 
+#ifdef __AVR__
 /* The CEC address of our current source */
 register unsigned char tv_logical_source asm("r4");
 
 /* State machine for searching for a new source */
 register unsigned char new_source_state asm("r3");
+#else
+static unsigned char tv_logical_source;
+static unsigned char new_source_state;
+#endif
 
 /* The physical address of our current source */
 static unsigned short tv_phys_source;
@@ -99,101 +228,310 @@ static unsigned short tv_phys_source;
  */
 static unsigned short new_routing_phys;
 
-/* Deck command to send to the current active source */
-static unsigned char deck_cmd;
-
-/* Tracking of serial reply from TV */
-static unsigned char serial_pos;
-static unsigned char serial_code;
-static unsigned char serial_ack1;
-static unsigned char serial_ack2;
-static unsigned char serial_resp;
-
 /* We need to send a message to the TV to indicate the current input */
 #define FLAG0_SEND_PHYS_SOURCE_SER	0
 
-/*
- * We need send a CEC set stream path message to indicate a new physical
- * source
- */
-#define FLAG0_SEND_PHYS_SOURCE_CEC	1
+/* Source came from the EEPROM snapshot, TV power not yet seen */
+#define FLAG0_RESTORED			1
 
-/*
- * A routing change message was received, process it after the routing
- * change timeout
- */
-#define FLAG0_ROUTING_CHANGE		2
+/* A complete reply from the TV is waiting in lg_resp */
+#define FLAG0_LG_RESPONSE		2
 
-/* Send a CEC button press release message */
-#define FLAG0_CEC_RELEASE		3
+/* The received frame is held for room to reply, and was counted */
+#define FLAG0_CEC_RX_HELD		3
 
 /* Send a CEC button press message */
 #define FLAG0_CEC_UI_COMMAND		4
 
-/* Notify active source that TV is turning off */
-#define FLAG0_ACTIVE_SOURCE		5
-
 /* Current key for TV should repeat every 100ms */
 #define FLAG0_KEY_REPEAT		6
 
 /* Current key for TV should send just once */
 #define FLAG0_KEY_ONCE			7
 
-/* Broadcast a CEC menu language message */
-#define FLAG1_MENU_LANG			0
+/* "ka 01 01\r" */
+#define LG_CMD_LEN			9
+
+/*
+ * Most commands on the wire at once without a reply. Two keep the TV
+ * busy, it answers one while the next goes out.
+ */
+#ifndef LG_PIPELINE
+#define LG_PIPELINE			2
+#endif
+
+/*
+ * Commands for the TV, queued or waiting for a reply. Anything more
+ * waits in its GPIOR0 flag or tv_state until there is room.
+ */
+#define LG_QUEUE			LG_PIPELINE
+
+/* How long the TV gets to answer a command */
+#define LG_REPLY_MS			100
+
+/*
+ * Attempts for commands that matter (power, input). The hold off between
+ * attempts starts at LG_REPLY_MS and doubles each time, so the last try
+ * goes out around 3 seconds after the first.
+ */
+#define LG_TRIES			6
+#define LG_BACKOFF_MAX			4
+
+/*
+ * Power state polling, every LG_POLL_MIN_MS while the TV is turning on or
+ * off. Once it settles the interval doubles while nothing happens, up to
+ * LG_POLL_MAX_MS. Set these to suit how quickly the TV model boots.
+ */
+#ifndef LG_POLL_MIN_MS
+#define LG_POLL_MIN_MS			125
+#endif
+#ifndef LG_POLL_MAX_MS
+#define LG_POLL_MAX_MS			2000
+#endif
+
+struct lg_queued {
+	unsigned char cmd1;
+	unsigned char cmd2;
+	unsigned char data;
+	unsigned char tries;
+};
+
+/*
+ * The TV answers in order, the first lg_sent entries are on the wire and
+ * the rest wait their turn.
+ */
+static struct lg_queued lg_queue[LG_QUEUE];
+static unsigned char lg_queued;
+static unsigned char lg_sent;
+static unsigned char lg_backoff;
+
+static unsigned char lg_poll_shift;
+static unsigned char lg_poll_state;
+
+/* Oldest queued frame of the least urgent class below class, if any */
+static unsigned char cec_tx_victim(unsigned char class)
+{
+	unsigned char i;
+	unsigned char victim = CEC_TX_QUEUE;
+
+	for (i = 0; i < cec_tx_count; i++) {
+		if (cec_txq[i].class > class) {
+			class = cec_txq[i].class;
+			victim = i;
+		}
+	}
+
+	return victim;
+}
+
+static void cec_tx_remove(unsigned char i)
+{
+	cec_tx_count--;
+	for (; i < cec_tx_count; i++)
+		cec_txq[i] = cec_txq[i + 1];
+}
+
+static bool cec_tx_room(unsigned char class)
+{
+	return cec_tx_count < CEC_TX_QUEUE ||
+					cec_tx_victim(class) < CEC_TX_QUEUE;
+}
+
+/*
+ * Queue a frame of len bytes, returns where to build it. A full queue
+ * drops a less urgent frame to make room, or returns NULL if there isn't
+ * one.
+ */
+static unsigned char *cec_tx_add(unsigned char class, unsigned char len,
+							unsigned char done)
+{
+	struct cec_tx *tx;
+
+	if (cec_tx_count == CEC_TX_QUEUE) {
+		unsigned char victim = cec_tx_victim(class);
+		if (victim == CEC_TX_QUEUE)
+			return NULL;
+		cec_tx_remove(victim);
+		DIAG_COUNT(cec_tx_drop);
+	}
+
+	tx = cec_txq + cec_tx_count++;
+	tx->class = class;
+	tx->done = done;
+	tx->len = len;
+	return tx->buf;
+}
+
+/* Notify active source that TV is turning off */
+static void cec_tv_active_source_off(void)
+{
+	unsigned char *buf;
+
+	buf = cec_tx_add(CEC_TX_ROUTING, 4, CEC_TX_DONE_NONE);
+	if (!buf)
+		return;
+
+	buf[0] = CEC_ADDR_BROADCAST;
+	buf[1] = CEC_MSG_ACTIVE_SOURCE;
+	buf[2] = 0;
+	buf[3] = 0;
+}
+
+/* Tell the switches about tv_phys_source, replacing any older request */
+static void cec_tv_stream_path(void)
+{
+	unsigned char *buf = NULL;
+	unsigned char i;
+
+	for (i = 0; i < cec_tx_count; i++)
+		if (cec_txq[i].buf[1] == CEC_MSG_SET_STREAM_PATH)
+			buf = cec_txq[i].buf;
 
-/* Broadcast a current physical address message */
-#define FLAG1_GIVE_PHYS			1
+	if (!buf)
+		buf = cec_tx_add(CEC_TX_ROUTING, 4, CEC_TX_DONE_NONE);
+	if (!buf)
+		return;
 
-/* Pause a little bit between serial messages */
-#define FLAG1_NEEDS_TX_PAUSE		2
+	buf[0] = CEC_ADDR_BROADCAST;
+	buf[1] = CEC_MSG_SET_STREAM_PATH;
+	buf[2] = tv_phys_source >> 8;
+	buf[3] = tv_phys_source;
+}
 
 /* New serial byte from the TV */
 static bool usi_uart_process_byte(void)
 {
+	int c;
 	unsigned char byte;
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		if (!ser_recv_ready)
-			return false;
 
-		byte = ser_recv_byte;
-		ser_recv_ready = false;
-	}
+	c = usi_uart_getc();
+	if (c < 0)
+		return false;
+	byte = c;
 
 	/* Been to long since last byte, this is a new message */
-	if (serial_rx_timeout < 0)
-		serial_pos = 0;
+	if (!timer_running(TIMER_SERIAL_RX))
+		lg_serial_reset();
 
-	serial_rx_timeout = MS_TO_LJIFFIES_UP(100);
+	timer_set(TIMER_SERIAL_RX, MS_TO_LJIFFIES_UP(100));
 
-	/* Final byte is always x */
-	if (byte == 'x') {
-		if (serial_pos == 7)
-			serial_resp = '0';
-		serial_pos = 0;
-		return true;
+	switch (lg_serial_rx(byte)) {
+	case LG_RX_DATA:
+		DIAG_EVENT(DIAG_EV_LG_DATA, lg_resp.byte);
+		break;
+
+	case LG_RX_DONE:
+		GPIOR0 |= _BV(FLAG0_LG_RESPONSE);
+		break;
 	}
 
-	/*
-	 * Format of LG messages:
-	 *
-	 * [Command2][ ][Set ID][ ][OK][Data][x]
-	 * [Command2][ ][Set ID][ ][NG][x]
-	 *
-	 * m 01 OK00x
-	 * m 01 NGx
-	 * 012345678
-	 */
-	if (serial_pos == 0)
-		serial_code = byte;
-	else if (serial_pos == 5)
-		serial_ack1 = byte;
-	else if (serial_pos == 6)
-		serial_ack2 = byte;
-	else if (serial_pos == 8)
-		serial_resp = byte;
+	return true;
+}
+
+static void lg_send(unsigned char cmd1, unsigned char cmd2,
+				unsigned char data, unsigned char tries)
+{
+	struct lg_queued *q = lg_queue + lg_queued++;
+
+	q->cmd1 = cmd1;
+	q->cmd2 = cmd2;
+	q->data = data;
+	q->tries = tries;
+}
+
+/* Wait a while before sending anything else to the TV */
+static void lg_hold_off(void)
+{
+	timer_set(TIMER_LG_RETRY, MS_TO_LJIFFIES_UP(LG_REPLY_MS) << lg_backoff);
+	if (lg_backoff < LG_BACKOFF_MAX)
+		lg_backoff++;
+}
+
+/* Match a reply from the TV with the command that caused it */
+static void lg_queue_reply(void)
+{
+	struct lg_queued q;
+	unsigned char i;
 
-	serial_pos++;
+	for (i = 0; i < lg_sent; i++)
+		if (lg_queue[i].cmd2 == lg_resp.cmd)
+			break;
+	if (i == lg_sent)
+		return;
+
+	q = lg_queue[i];
+	lg_sent--;
+
+	/* NG to the power query only means the TV is off */
+	if (lg_resp.status == LG_NG && q.cmd2 != 'm')
+		DIAG_COUNT(lg_ng);
+	for (; i < lg_sent; i++)
+		lg_queue[i] = lg_queue[i + 1];
+
+	if (lg_resp.status == LG_NG && --q.tries) {
+		/* Not now, try it again first thing */
+		lg_queue[lg_sent] = q;
+		lg_hold_off();
+	} else {
+		lg_queued--;
+		for (; i < lg_queued; i++)
+			lg_queue[i] = lg_queue[i + 1];
+		if (lg_resp.status == LG_OK)
+			lg_backoff = 0;
+	}
+
+	if (lg_sent)
+		timer_set(TIMER_LG_REPLY, MS_TO_LJIFFIES_UP(LG_REPLY_MS));
+	else
+		timer_cancel(TIMER_LG_REPLY);
+}
+
+/* No reply from the TV, send everything on the wire again or give up */
+static void lg_reply_timeout(void)
+{
+	unsigned char i, j;
+
+	for (i = j = 0; i < lg_queued; i++) {
+		if (i < lg_sent && !--lg_queue[i].tries) {
+			DIAG_COUNT(lg_timeout);
+			continue;
+		}
+		lg_queue[j++] = lg_queue[i];
+	}
+	lg_queued = j;
+	lg_sent = 0;
+	lg_hold_off();
+}
+
+/* Put the next queued command on the wire */
+static bool lg_queue_tx(void)
+{
+	struct lg_queued *q;
+
+	if (lg_sent == lg_queued || lg_sent == LG_PIPELINE)
+		return false;
+
+	if (timer_running(TIMER_LG_RETRY))
+		return false;
+
+	/* Queue behind whatever is still going out */
+	if (usi_uart_tx_free() < LG_CMD_LEN)
+		return false;
+
+	q = lg_queue + lg_sent;
+	DIAG_EVENT(DIAG_EV_LG_TX, q->cmd2);
+	usi_uart_put(q->cmd1);
+	usi_uart_put(q->cmd2);
+	usi_uart_put(' ');
+	usi_uart_put('0');
+	usi_uart_put('1');
+	usi_uart_put(' ');
+	usi_uart_num(q->data >> 4);
+	usi_uart_num(q->data & 0xf);
+	usi_uart_put('\r');
+
+	if (!lg_sent++)
+		timer_set(TIMER_LG_REPLY, MS_TO_LJIFFIES_UP(LG_REPLY_MS));
 
 	return true;
 }
@@ -201,52 +539,166 @@ static bool usi_uart_process_byte(void)
 /* Process complete serial message from TV */
 static void lg_response(void)
 {
-	if (serial_code != 'm')
+	DIAG_EVENT(lg_resp.status == LG_OK ? DIAG_EV_LG_OK : DIAG_EV_LG_NG,
+								lg_resp.cmd);
+	lg_queue_reply();
+
+	if (lg_resp.cmd != 'm')
 		return;
 
 	/*
 	 * The TV always responds to a power query with zero. However, it will
 	 * respond to a remotelock query with NG when off and OK when on.
 	 */
-	if (serial_ack1 == 'O' && serial_ack2 == 'K') {
+	if (lg_resp.status == LG_OK) {
 		/* OK, TV is on */
 #ifdef CEC_TV_LOCK
 		/* Lock check */
 		if (tv_state == TV_POWERING_UP)
-			tv_state = serial_resp == '1' ? TV_SCAN : TV_DO_LOCK;
+			tv_state = lg_resp.len && lg_resp.data[0] == 1 ? TV_SCAN : TV_DO_LOCK;
 #endif
 		if (tv_state != TV_POWERING_OFF && tv_state != TV_POWER_OFF) {
-			if (tv_state == TV_OFF && tv_logical_source) {
+			/* A TV that was already on kept its own input */
+			if (tv_state == TV_OFF && tv_logical_source &&
+					!(GPIOR0 & _BV(FLAG0_RESTORED))) {
 				GPIOR0 |= _BV(FLAG0_SEND_PHYS_SOURCE_SER);
-				GPIOR0 |= _BV(FLAG0_SEND_PHYS_SOURCE_CEC);
+				cec_tv_stream_path();
 			}
 			tv_state = TV_ON;
 		}
-	} else if (serial_ack1 == 'N' && serial_ack2 == 'G') {
+	} else if (lg_resp.status == LG_NG) {
 		/* NG, TV is off */
 		if (tv_state != TV_POWERING_UP && tv_state != TV_POWER_UP) {
 			if (tv_state == TV_ON)
-				GPIOR0 |= _BV(FLAG0_ACTIVE_SOURCE);
+				cec_tv_active_source_off();
 			tv_state = TV_OFF;
+			lg_serial_forget(LG_CMD_INPUT);
 		}
 	}
+	GPIOR0 &= ~_BV(FLAG0_RESTORED);
+
+	/* Something changed, go back to polling quickly */
+	if (tv_state != lg_poll_state)
+		timer_cancel(TIMER_TV_QUERY);
 }
 
-/* Periodic things that need to send on the serial port */
-static bool cec_tv_periodic_serial_tx(void)
+/* Time until the next power poll */
+static unsigned int lg_poll_ticks(void)
 {
-	unsigned char cmd1, cmd2, code;
+	unsigned int ticks;
 
-	if (!usi_uart_write_empty())
-		return false;
+	if (tv_state != lg_poll_state) {
+		lg_poll_state = tv_state;
+		lg_poll_shift = 0;
+	}
+
+	if (tv_state == TV_POWERING_UP || tv_state == TV_POWERING_OFF)
+		return MS_TO_LJIFFIES_UP(LG_POLL_MIN_MS);
+
+	ticks = MS_TO_LJIFFIES_UP(LG_POLL_MIN_MS) << lg_poll_shift;
+	if (ticks >= MS_TO_LJIFFIES_UP(LG_POLL_MAX_MS))
+		return MS_TO_LJIFFIES_UP(LG_POLL_MAX_MS);
+
+	lg_poll_shift++;
+	return ticks;
+}
+
+/* Diagnostic block being written out of the serial port */
+static unsigned char diag_dump_block;
+static unsigned char diag_dump_pos;
+static bool diag_dumping;
+
+static void diag_dump_hex(unsigned char val)
+{
+	usi_uart_num(val >> 4);
+	usi_uart_num(val & 0xf);
+}
 
-	if (GPIOR1 & _BV(FLAG1_NEEDS_TX_PAUSE))
-		serial_tx_timeout = MS_TO_LJIFFIES_UP(5);
-	GPIOR1 &= ~_BV(FLAG1_NEEDS_TX_PAUSE);
+/* "zz 01 " + block, offset and data in hex + "\r", filling the ring */
+#define DIAG_DUMP_DATA	((USI_UART_TX_SIZE - 1 - (6 + 2 * 2 + 1)) / 2)
+#define DIAG_DUMP_LEN	(6 + 2 * (2 + DIAG_DUMP_DATA) + 1)
+
+/* Write the next line of a diagnostic dump, see diag.h */
+static bool diag_dump_tx(void)
+{
+	unsigned char buf[DIAG_DUMP_DATA];
+	unsigned char *p;
+	unsigned char size;
+	unsigned char n;
+	unsigned char i;
 
-	if (serial_tx_timeout >= 0)
+	if (!diag_dumping || usi_uart_tx_free() < DIAG_DUMP_LEN)
 		return false;
 
+	p = diag_block(diag_dump_block, &size);
+	n = size - diag_dump_pos;
+	if (n > DIAG_DUMP_DATA)
+		n = DIAG_DUMP_DATA;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memcpy(buf, p + diag_dump_pos, n);
+	}
+
+	usi_uart_put('z');
+	usi_uart_put('z');
+	usi_uart_put(' ');
+	usi_uart_put('0');
+	usi_uart_put('1');
+	usi_uart_put(' ');
+	diag_dump_hex(diag_dump_block);
+	diag_dump_hex(diag_dump_pos);
+	for (i = 0; i < n; i++)
+		diag_dump_hex(buf[i]);
+	usi_uart_put('\r');
+
+	diag_dump_pos += n;
+	if (diag_dump_pos == size)
+		diag_dumping = false;
+
+	return true;
+}
+
+#ifdef DIAG_TRACE
+/* What the trace last saw, to record changes */
+static unsigned char diag_trace_tv_state = 0xff;
+static unsigned char diag_trace_source = 0xff;
+static unsigned char diag_trace_input = 0xff;
+
+/* Trace changes to the TV power state, active source and input */
+static void cec_tv_trace(void)
+{
+	if (diag_trace_tv_state != tv_state) {
+		diag_trace_tv_state = tv_state;
+		DIAG_EVENT(DIAG_EV_TV_STATE, tv_state);
+	}
+	if (diag_trace_source != tv_logical_source) {
+		diag_trace_source = tv_logical_source;
+		DIAG_EVENT(DIAG_EV_SOURCE, tv_logical_source);
+	}
+	if (diag_trace_input != tv_phys_source >> 12) {
+		diag_trace_input = tv_phys_source >> 12;
+		DIAG_EVENT(DIAG_EV_INPUT, diag_trace_input);
+	}
+}
+#else
+#define cec_tv_trace() do {} while (0)
+#endif
+
+/* Start turning the TV on or off right away */
+static void cec_tv_power(unsigned char state)
+{
+	tv_state = state;
+	timer_cancel(TIMER_TV_QUERY);
+}
+
+/* Periodic things that need to send on the serial port */
+static bool cec_tv_periodic_serial_tx(void)
+{
+	unsigned char cmd1, cmd2, code;
+	unsigned char tries = 1;
+
+	if (lg_queued == LG_QUEUE)
+		return lg_queue_tx();
+
 	/* Pass through keypresses */
 	if (GPIOR0 & _BV(FLAG0_KEY_ONCE)) {
 		GPIOR0 &= ~_BV(FLAG0_KEY_ONCE);
@@ -254,13 +706,16 @@ static bool cec_tv_periodic_serial_tx(void)
 	}
 
 	/* Volume up/down repeat */
-	if ((GPIOR0 & _BV(FLAG0_KEY_REPEAT)) && repeat_timeout < 0) {
-		repeat_timeout = MS_TO_LJIFFIES_UP(100);
+	if ((GPIOR0 & _BV(FLAG0_KEY_REPEAT)) && !timer_running(TIMER_REPEAT)) {
+		timer_set(TIMER_REPEAT, MS_TO_LJIFFIES_UP(100));
 send_key:
 		cmd1 = 'm';
 		cmd2 = 'c';
 		code = serial_key_code;
 
+		/* Any key might move the TV off our input */
+		lg_serial_forget(LG_CMD_INPUT);
+
 		/*
 		 * Argh....sometimes sending mute twice pops up a menu.
 		 * Sending an extra "any" key between mute presses avoids
@@ -283,12 +738,22 @@ send_key:
 		/* 4 nibble physical address, we want the first nibble */
 		code = tv_phys_source >> 12;
 		code += 0x90 - 1;
+		tries = LG_TRIES;
+
+		/* Already there according to the last xb reply */
+		if (lg_state[LG_CMD_INPUT].status == LG_OK &&
+					lg_state[LG_CMD_INPUT].value == code)
+			return true;
 		goto send1;
 	}
 
-	/* Periodic requests to TV */
-	if (tv_query_timeout > 0)
-		return false;
+	/* Diagnostic dump, between commands to the TV */
+	if (!lg_queued && diag_dump_tx())
+		return true;
+
+	/* Periodic requests to TV, once everything else is out */
+	if (timer_running(TIMER_TV_QUERY) || lg_queued)
+		return lg_queue_tx();
 
 	cmd1 = 'k';
 	cmd2 = 'a';
@@ -299,103 +764,244 @@ send_key:
 		 * (if one isn't received?)
 		 */
 		code = 1;
+		tries = LG_TRIES;
 		tv_state = TV_POWERING_UP;
+		lg_serial_forget(LG_CMD_POWER);
+		lg_serial_forget(LG_CMD_INPUT);
 		break;
 
 	case TV_POWER_OFF:
 		code = 0;
+		tries = LG_TRIES;
 		tv_state = TV_POWERING_OFF;
+		lg_serial_forget(LG_CMD_POWER);
+		lg_serial_forget(LG_CMD_INPUT);
 		break;
 
 #if CEC_TV_LOCK
 	case TV_DO_LOCK:
 		/* Need to lock */
-		usi_uart_write("km 01 01\r", 9);
+		cmd2 = 'm';
+		code = 1;
 		tv_state = TV_POWERING_UP;
 		break;
 #endif
 	default:
-		if (tv_state == TV_POWERING_UP)
-			tv_state = TV_POWER_UP;
-		else if (tv_state == TV_POWERING_OFF)
-			tv_state = TV_POWER_OFF;
+		/* Try again if the TV never took the power command */
+		if (lg_state[LG_CMD_POWER].status != LG_OK) {
+			if (tv_state == TV_POWERING_UP)
+				tv_state = TV_POWER_UP;
+			else if (tv_state == TV_POWERING_OFF)
+				tv_state = TV_POWER_OFF;
+		}
 		cmd2 = 'm';
 		code = 0xff;
 	}
 
-	tv_query_timeout = MS_TO_LJIFFIES_UP(1000);
+	timer_set(TIMER_TV_QUERY, lg_poll_ticks());
 send1:
-	usi_uart_put(cmd1);
-	usi_uart_put(cmd2);
-	usi_uart_put(' ');
-	usi_uart_put('0');
-	usi_uart_put('1');
-	usi_uart_put(' ');
-	usi_uart_num(code >> 4);
-	usi_uart_num(code & 0xf);
-	usi_uart_put('\r');
-	GPIOR1 |= _BV(FLAG1_NEEDS_TX_PAUSE);
+	lg_send(cmd1, cmd2, code, tries);
+	lg_queue_tx();
 	return true;
 }
 
-/* Called by IR subsystem when a button release occurs */
-IR_NEC_PUBLIC void ir_nec_release(void)
+/* The remote key was let go, stop any key we are holding down */
+static void cec_tv_key_release(void)
 {
+	unsigned char *buf;
+
 	if (GPIOR0 & _BV(FLAG0_CEC_UI_COMMAND)) {
 		GPIOR0 &= ~_BV(FLAG0_CEC_UI_COMMAND);
-		GPIOR0 |= _BV(FLAG0_CEC_RELEASE);
+		if (tv_logical_source) {
+			buf = cec_tx_add(CEC_TX_UI, 2, CEC_TX_DONE_NONE);
+			if (buf) {
+				buf[0] = tv_logical_source;
+				buf[1] = CEC_MSG_USER_CONTROL_RELEASED;
+			}
+		}
 	}
 	GPIOR0 &= ~_BV(FLAG0_KEY_ONCE);
 	GPIOR0 &= ~_BV(FLAG0_KEY_REPEAT);
 }
 
-/* Periodically check if there is a new IR button press */
-static bool ir_nec_press_periodic(void)
-{
-	unsigned char code;
+/* The default keymap's runs, found at boot, EEPROM offsets */
+static unsigned char keymap_default;
+static unsigned char keymap_default_end;
 
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		if (!ir_nec_ready)
-			return false;
-		ir_nec_ready = false;
-		if (ir_nec_output[0] != 4)
-			return false;
-		code = ir_nec_output[1];
-	}
+/*
+ * The runs of the current source's keymap, 0 if it has none. A press walks
+ * them in the EEPROM, then the default map if the source doesn't override
+ * the code.
+ */
+static unsigned char keymap_src;
+static unsigned char keymap_src_end;
+static unsigned char keymap_source;
 
-	ir_nec_release();
+static unsigned char keymap_byte(unsigned short pos)
+{
+	return eeprom_read_byte((const unsigned char *) (size_t) pos);
+}
 
-	switch (code) {
-	case KEY_POWER:
-		if (tv_state == TV_ON) {
-			tv_state = TV_POWER_OFF;
-			GPIOR0 |= _BV(FLAG0_ACTIVE_SOURCE);
-		} else if (tv_state == TV_OFF) {
-			tv_state = TV_POWER_UP;
-			if (tv_logical_source) {
-				GPIOR0 |= _BV(FLAG0_SEND_PHYS_SOURCE_SER);
-				GPIOR0 |= _BV(FLAG0_SEND_PHYS_SOURCE_CEC);
-			}
+/* Find the map for key, returns the end of its runs and sets *start */
+static unsigned char keymap_map(unsigned char key, unsigned char *start)
+{
+	unsigned short pos = KEYMAP_ADDR;
+	unsigned short end;
+
+	while (pos < KEYMAP_END - 1) {
+		end = pos + 2 + keymap_byte(pos + 1);
+		if (end > KEYMAP_END)
+			break;
+		if (keymap_byte(pos) == key) {
+			*start = pos + 2;
+			return end;
 		}
-		break;
+		pos = end;
 	}
 
-	/* Ignore other remote keys when off */
-	if (tv_state != TV_ON)
-		return true;
+	*start = 0;
+	return 0;
+}
 
-	serial_key_code = code;
+/* Key for the i'th code of the run with header hdr and data at pos */
+static unsigned char keymap_key(unsigned short pos, unsigned char hdr,
+							unsigned char i)
+{
+	if (!(hdr & KEYMAP_RUN_STEP))
+		return keymap_byte(pos + i);
+	if ((hdr & KEYMAP_RUN_FILL) == KEYMAP_RUN_FILL)
+		return keymap_byte(pos);
+	return keymap_byte(pos) + i;
+}
 
-	switch (code) {
-	case KEY_INPUT:
-		/* Next input */
-		if (new_source_state == NEW_SOURCE_IDLE)
-			new_source_state = NEW_SOURCE_PICK;
-		break;
+/*
+ * Walk the runs from pos to end and return the key for code, KEYMAP_INHERIT
+ * if the map doesn't have it
+ */
+static unsigned char keymap_walk(unsigned short pos, unsigned char end,
+							unsigned char code)
+{
+	unsigned char first;
+	unsigned char hdr;
+	unsigned char i;
+
+	while (pos + 2 < end) {
+		first = keymap_byte(pos);
+		hdr = keymap_byte(pos + 1);
+		pos += 2;
+
+		/* Runs are sorted, so we're past it */
+		if (first > code)
+			break;
+		i = code - first;
+		if (i <= (hdr & KEYMAP_RUN_LEN))
+			return keymap_key(pos, hdr, i);
+
+		pos += hdr & KEYMAP_RUN_STEP ? 1 : (hdr & KEYMAP_RUN_LEN) + 1;
+	}
+
+	return KEYMAP_INHERIT;
+}
+
+/* Find the map for the current source */
+static void keymap_load(void)
+{
+	keymap_source = tv_logical_source;
+	keymap_src_end = keymap_map(keymap_source, &keymap_src);
+}
+
+/* Translate a remote code for the current source, 0xff if unmapped */
+static unsigned char keymap_lookup(unsigned char code)
+{
+	unsigned char key = KEYMAP_INHERIT;
+
+	if (keymap_source != tv_logical_source)
+		keymap_load();
+
+	if (keymap_src)
+		key = keymap_walk(keymap_src, keymap_src_end, code);
+	if (key == KEYMAP_INHERIT)
+		key = keymap_walk(keymap_default, keymap_default_end, code);
+	return key == KEYMAP_INHERIT ? 0xff : key;
+}
+
+/*
+ * Remotes whose commands are taken as LG key codes, protocol and address.
+ * Universal remotes and IR blasters can be added here once they are set
+ * up to send the LG codes in whichever protocol they speak.
+ */
+static const unsigned char ir_nec_remotes[][3] PROGMEM = {
+	{ IR_NEC, 0x04, 0x00 },		/* LG TV remote */
+};
+
+static bool ir_nec_remote(const struct ir_event *ev)
+{
+	unsigned char i;
+
+	for (i = 0; i < sizeof(ir_nec_remotes) / sizeof(*ir_nec_remotes); i++)
+		if (pgm_read_byte(&ir_nec_remotes[i][0]) == ev->protocol &&
+				pgm_read_word(&ir_nec_remotes[i][1]) ==
+								ev->address)
+			return true;
+
+	return false;
+}
+
+/* Periodically check for IR key events */
+static bool ir_nec_press_periodic(void)
+{
+	struct ir_event ev;
+	unsigned char code;
+	unsigned char deck_cmd = 0;
+	unsigned char *buf;
+
+	/* Keys may need the keymap, leave them queued while the EEPROM writes */
+	if (!eeprom_is_ready() || !ir_nec_get(&ev))
+		return false;
+
+	if (ev.type == IR_RELEASE) {
+		cec_tv_key_release();
+		return true;
+	}
+
+	/* A held key stays pressed until its release */
+	if (ev.type == IR_REPEAT || !ir_nec_remote(&ev))
+		return true;
+	code = ev.command;
+
+	cec_tv_key_release();
+
+	switch (code) {
+	case KEY_POWER:
+		if (tv_state == TV_ON) {
+			cec_tv_power(TV_POWER_OFF);
+			cec_tv_active_source_off();
+		} else if (tv_state == TV_OFF) {
+			cec_tv_power(TV_POWER_UP);
+			if (tv_logical_source) {
+				GPIOR0 |= _BV(FLAG0_SEND_PHYS_SOURCE_SER);
+				cec_tv_stream_path();
+			}
+		}
+		break;
+	}
+
+	/* Ignore other remote keys when off */
+	if (tv_state != TV_ON)
+		return true;
+
+	serial_key_code = code;
+
+	switch (code) {
+	case KEY_INPUT:
+		/* Next input */
+		if (new_source_state == NEW_SOURCE_IDLE)
+			new_source_state = NEW_SOURCE_PICK;
+		break;
 
 	case KEY_VOL_UP:
 	case KEY_VOL_DOWN:
-		repeat_timeout = MS_TO_LJIFFIES_UP(500);
+		timer_set(TIMER_REPEAT, MS_TO_LJIFFIES_UP(500));
 		GPIOR0 |= _BV(FLAG0_KEY_REPEAT);
 		/* Fall-through for KEY_ONCE */
 
@@ -441,202 +1047,550 @@ static bool ir_nec_press_periodic(void)
 		if (!tv_logical_source)
 			break;
 
-		/* Lookup the translated CEC key in the EEPROM */
-		EEAR = code + 0x10;
-		EECR |= _BV(EERE);
-		cec_ui_command = EEDR;
+		/* Lookup the translated CEC key for this source */
+		cec_ui_command = keymap_lookup(code);
 		if (cec_ui_command == 0xff)
 			return true;
 		GPIOR0 |= _BV(FLAG0_CEC_UI_COMMAND);
-		repeat_timeout = 0;
+		timer_cancel(TIMER_REPEAT);
+	}
+
+	/* Deck command for the current active source */
+	if (deck_cmd && tv_logical_source) {
+		buf = cec_tx_add(CEC_TX_UI, 3, CEC_TX_DONE_NONE);
+		if (buf) {
+			buf[0] = tv_logical_source;
+			if (deck_cmd > CEC_MSG_DECK_CONTROL_MODE_EJECT)
+				buf[1] = CEC_MSG_PLAY;
+			else
+				buf[1] = CEC_MSG_DECK_CONTROL;
+			buf[2] = deck_cmd;
+		}
 	}
 
 	return true;
 }
 
-/* Periodic things that need to send CEC messages */
-static bool cec_tv_periodic_cec_tx(void)
+/* The TV is answering a directed message from source */
+static void cec_tv_reply(unsigned char source, unsigned char opcode)
 {
-	unsigned char end;
 	unsigned char *buf;
+	unsigned char len;
 
-	/*
-	 * Convince GCC to let us use indirect addressing. This lets us use 2
-	 * byte opcodes to access memory rather than 4.
-	 */
-	asm("ldi %A0, lo8(transmit_buf)\n"
-	    "ldi %B0, hi8(transmit_buf)\n" : "=b"(buf));
-
-	if (transmit_state >= TRANSMIT_PEND)
-		return false;
-
-	/* Handle message replies that get sent back to the initiator */
-	if (recv_pend_cnt) {
-		unsigned char *pend_buf;
-		unsigned char source;
-		unsigned char opcode;
-
-		recv_pend_cnt -= 2;
-		pend_buf = recv_pend + recv_pend_cnt;
-		source = *pend_buf++;
-		opcode = *pend_buf++;
-
-		buf[0] = source;
-		switch (opcode) {
-		case CEC_MSG_GET_CEC_VERSION:
-			/* Send CEC_MSG_CEC_VERSION <version> */
-			buf[1] = CEC_MSG_CEC_VERSION;
-			buf[2] = CEC_MSG_CEC_VERSION_1_4;
-			end = 2;
-			break;
-
-		case CEC_MSG_GIVE_DEVICE_POWER_STATUS:
-			buf[1] = CEC_MSG_REPORT_POWER_STATUS;
-			if (tv_state == TV_ON)
-				buf[2] = CEC_MSG_POWER_STATUS_ON;
-			else if (tv_state == TV_OFF)
-				buf[2] = CEC_MSG_POWER_STATUS_STANDBY;
-			else if (tv_state >= TV_POWER_UP)
-				buf[2] = CEC_MSG_POWER_STATUS_2ON;
-			else
-				buf[2] = CEC_MSG_POWER_STATUS_2STANDBY;
-			end = 2;
-			break;
-
-		default:
-			/* Send CEC_MSG_ABORT <unk opcode> */
-			buf[1] = CEC_MSG_FEATURE_ABORT;
-			buf[2] = opcode;
-			buf[3] = CEC_MSG_ABORT_REASON_OPCODE;
-			end = 3;
-		}
-
-		goto xmit;
-	}
+	buf = cec_tx_add(CEC_TX_REPLY, CEC_TX_MAX, CEC_TX_DONE_NONE);
+	if (!buf)
+		return;
 
-	buf[0] = CEC_ADDR_BROADCAST;
+	buf[0] = source;
+	len = 3;
+	switch (opcode) {
+	case CEC_MSG_GET_CEC_VERSION:
+		/* Send CEC_MSG_CEC_VERSION <version> */
+		buf[1] = CEC_MSG_CEC_VERSION;
+		buf[2] = CEC_MSG_CEC_VERSION_1_4;
+		break;
 
-	/* Broadcast message replies */
-	if (GPIOR1 & _BV(FLAG1_MENU_LANG)) {
-		GPIOR1 &= ~_BV(FLAG1_MENU_LANG);
+	case CEC_MSG_GIVE_DEVICE_POWER_STATUS:
+		buf[1] = CEC_MSG_REPORT_POWER_STATUS;
+		if (tv_state == TV_ON)
+			buf[2] = CEC_MSG_POWER_STATUS_ON;
+		else if (tv_state == TV_OFF)
+			buf[2] = CEC_MSG_POWER_STATUS_STANDBY;
+		else if (tv_state >= TV_POWER_UP)
+			buf[2] = CEC_MSG_POWER_STATUS_2ON;
+		else
+			buf[2] = CEC_MSG_POWER_STATUS_2STANDBY;
+		break;
 
+	case CEC_MSG_GET_MENU_LANGUAGE:
+		buf[0] = CEC_ADDR_BROADCAST;
 		buf[1] = CEC_MSG_SET_MENU_LANGUAGE;
 		buf[2] = 'e';
 		buf[3] = 'n';
 		buf[4] = 'g';
-		end = 4;
-		goto xmit;
-	}
-
-	if (GPIOR1 & _BV(FLAG1_GIVE_PHYS)) {
-		GPIOR1 &= ~_BV(FLAG1_GIVE_PHYS);
+		len = 5;
+		break;
 
+	case CEC_MSG_GIVE_PHYSICAL_ADDRESS:
+		buf[0] = CEC_ADDR_BROADCAST;
 		buf[1] = CEC_MSG_REPORT_PHYSICAL_ADDRESS;
 		buf[2] = 0;
 		buf[3] = 0;
 		buf[4] = CEC_MSG_DEVICE_TYPE_TV;
-		end = 4;
-		goto xmit;
+		len = 5;
+		break;
+
+	default:
+		/* Send CEC_MSG_ABORT <unk opcode> */
+		buf[1] = CEC_MSG_FEATURE_ABORT;
+		buf[2] = opcode;
+		buf[3] = CEC_MSG_ABORT_REASON_OPCODE;
+		len = 4;
 	}
 
-	/* Pending button release */
-	if (GPIOR0 & _BV(FLAG0_CEC_RELEASE)) {
-		GPIOR0 &= ~_BV(FLAG0_CEC_RELEASE);
-		if (tv_logical_source) {
-			buf[0] = tv_logical_source;
-			buf[1] = CEC_MSG_USER_CONTROL_RELEASED;
-			end = 1;
-			goto xmit;
+	/* Our frame is the newest one */
+	cec_txq[cec_tx_count - 1].len = len;
+}
+
+/* Table entry for addr, NULL if we don't know it */
+static struct cec_tv_dev *cec_tv_dev(unsigned char addr)
+{
+	unsigned char i;
+
+	if (!(source_known & (1 << addr)))
+		return NULL;
+
+	for (i = 0; i < CEC_TV_DEVS; i++)
+		if (cec_tv_devs[i].id >> 4 == addr)
+			return cec_tv_devs + i;
+
+	return NULL;
+}
+
+/* Table entry for addr, making room for it if it is new */
+static struct cec_tv_dev *cec_tv_dev_add(unsigned char addr,
+							unsigned char type)
+{
+	struct cec_tv_dev *dev = cec_tv_dev(addr);
+	unsigned char now = CEC_TV_NOW();
+	unsigned char oldest = 0;
+	unsigned char i;
+
+	if (!dev) {
+		for (i = 0; i < CEC_TV_DEVS; i++) {
+			struct cec_tv_dev *d = cec_tv_devs + i;
+
+			if (!d->id) {
+				dev = d;
+				break;
+			}
+
+			/* Only one entry is the active source, so dev gets set */
+			if (d->id >> 4 != tv_logical_source &&
+					(unsigned char) (now - d->seen) >= oldest) {
+				oldest = now - d->seen;
+				dev = d;
+			}
 		}
+		source_known &= ~(1 << (dev->id >> 4));
 	}
 
+	source_known |= 1 << addr;
+	dev->id = addr << 4 | (type & 0xf);
+	dev->seen = now;
+	return dev;
+}
+
+/*
+ * Poll everything we haven't heard from lately. seen only counts to 255
+ * seconds, so a device we haven't heard from in CEC_TV_SWEEP_S stays at
+ * that age rather than wrap around and look fresh.
+ */
+static void cec_tv_sweep(void)
+{
+	unsigned char now = CEC_TV_NOW();
+	struct cec_tv_dev *dev;
+	unsigned char addr;
+
+	for (addr = 1; addr < CEC_ADDR_BROADCAST; addr++) {
+		if (sweep_nacked & (1 << addr))
+			continue;
+
+		dev = cec_tv_dev(addr);
+		if (!dev) {
+			sweep_pending |= 1 << addr;
+		} else if ((unsigned char) (now - dev->seen) >= CEC_TV_SWEEP_S) {
+			dev->seen = now - CEC_TV_SWEEP_S;
+			sweep_pending |= 1 << addr;
+		}
+	}
+}
+
+/* Time for the next sweep, everyone gets another try */
+static void cec_tv_sweep_timer(void)
+{
+	sweep_nacked = 0;
+	cec_tv_sweep();
+}
+
+/* A sweep poll went out, nobody taking it means the device is gone */
+static void cec_tv_sweep_done(unsigned char target, bool acked)
+{
+	struct cec_tv_dev *dev = cec_tv_dev(target);
+
+	if (!acked)
+		sweep_nacked |= 1 << target;
+
+	if (!dev)
+		return;
+
+	if (acked) {
+		dev->seen = CEC_TV_NOW();
+	} else {
+		dev->id = 0;
+		source_known &= ~(1 << target);
+	}
+}
+
+/* Switch to the next source in the table after next_source */
+static bool cec_tv_pick(void)
+{
+	unsigned short avail = source_known & source_present;
+	unsigned char i;
+
+	for (i = 1; i < CEC_ADDR_BROADCAST; i++) {
+		next_source++;
+		if (next_source >= CEC_ADDR_BROADCAST)
+			next_source = 1;
+		if (!(avail & (1 << next_source)))
+			continue;
+
+		tv_logical_source = next_source;
+		tv_phys_source = cec_tv_dev(next_source)->phys;
+		timer_cancel(TIMER_ROUTING_CHANGE);
+		new_source_state = NEW_SOURCE_IDLE;
+
+		if (tv_state >= TV_POWER_UP) {
+			GPIOR0 |= _BV(FLAG0_SEND_PHYS_SOURCE_SER);
+			cec_tv_stream_path();
+		}
+		return true;
+	}
+
+	return false;
+}
+
+/* Queue frames that depend on timers or the new source state machine */
+static bool cec_tv_cec_produce(void)
+{
+	unsigned char *buf;
+
 	/* Pending button repeat */
-	if ((GPIOR0 & _BV(FLAG0_CEC_UI_COMMAND)) && repeat_timeout <= 0) {
-		if (!tv_logical_source)
+	if ((GPIOR0 & _BV(FLAG0_CEC_UI_COMMAND)) && !timer_running(TIMER_REPEAT)) {
+		if (!tv_logical_source) {
 			GPIOR0 &= ~_BV(FLAG0_CEC_UI_COMMAND);
-		else {
-			repeat_timeout = MS_TO_LJIFFIES_UP(400);
+		} else if ((buf = cec_tx_add(CEC_TX_UI, 3, CEC_TX_DONE_NONE))) {
+			timer_set(TIMER_REPEAT, MS_TO_LJIFFIES_UP(400));
 
 			buf[0] = tv_logical_source;
 			buf[1] = CEC_MSG_USER_CONTROL_PRESSED;
 			buf[2] = cec_ui_command;
-			end = 2;
-			goto xmit;
+			return true;
 		}
 	}
 
-	if (deck_cmd) {
-		buf[0] = tv_logical_source;
-		if (deck_cmd > CEC_MSG_DECK_CONTROL_MODE_EJECT)
-			buf[1] = CEC_MSG_PLAY;
-		else
-			buf[1] = CEC_MSG_DECK_CONTROL;
-		buf[2] = deck_cmd;
-		deck_cmd = 0;
-		end = 2;
-		if (tv_logical_source)
-			goto xmit;
+	/* Sweep polls go out in a burst, leaving room for anything urgent */
+	if (sweep_pending && cec_tx_count < CEC_TX_QUEUE - 1) {
+		unsigned char addr = 1;
+
+		while (!(sweep_pending & (1 << addr)))
+			addr++;
+		sweep_pending &= ~(1 << addr);
+		if (!sweep_pending)
+			timer_set(TIMER_SWEEP, MS_TO_LJIFFIES_UP(CEC_TV_SWEEP_S * 1000UL));
+
+		buf = cec_tx_add(CEC_TX_POLL, 2, CEC_TX_DONE_SWEEP);
+		buf[0] = addr;
+		buf[1] = CEC_MSG_GIVE_PHYSICAL_ADDRESS;
+		return true;
 	}
 
-	if (GPIOR0 & _BV(FLAG0_ACTIVE_SOURCE)) {
-		/* Notify current active source tv is turning off */
-		GPIOR0 &= ~_BV(FLAG0_ACTIVE_SOURCE);
+	return false;
+}
 
-		buf[1] = CEC_MSG_ACTIVE_SOURCE;
-		buf[2] = 0;
-		buf[3] = 0;
-		end = 3;
-		goto xmit;
+/* Check for nacks/acks on the last frame we sent */
+static bool cec_tv_cec_tx_done(void)
+{
+	unsigned char target;
+
+	if (!transmit_buf[0] || transmit_state >= TRANSMIT_PEND)
+		return false;
 
-	} else if (GPIOR0 & _BV(FLAG0_SEND_PHYS_SOURCE_CEC)) {
-		GPIOR0 &= ~_BV(FLAG0_SEND_PHYS_SOURCE_CEC);
+	target = transmit_buf[0] & 0xf;
+	DIAG_EVENT((transmit_state == TRANSMIT_FAILED ? DIAG_EV_CEC_NACK :
+			DIAG_EV_CEC_ACK) | target,
+			transmit_buf_end ? transmit_buf[1] : 0xff);
+	if (transmit_state == TRANSMIT_FAILED) {
+		DIAG_COUNT(cec_tx_nack);
+
+		/* This source clearly isn't there */
+		source_present &= ~(1 << target);
+		if (target == tv_logical_source)
+			/* It was our active source, pick a new one */
+			new_source_state = NEW_SOURCE_PICK;
+	} else {
+		DIAG_COUNT(cec_tx_ack);
+		source_present |= 1 << target;
+	}
+	transmit_buf[0] = 0;
 
-		buf[1] = CEC_MSG_SET_STREAM_PATH;
-		buf[2] = tv_phys_source >> 8;
-		buf[3] = tv_phys_source;
-		end = 3;
-		goto xmit;
+	if (cec_tx_done == CEC_TX_DONE_SWEEP)
+		cec_tv_sweep_done(target, transmit_state != TRANSMIT_FAILED);
 
-	} else if (new_source_state == NEW_SOURCE_LOGICAL) {
-		next_source++;
-		if (next_source == CEC_ADDR_BROADCAST)
-			next_source = 1;
-		if (source_present & (1 << next_source)) {
-			new_source_timeout = MS_TO_LJIFFIES_UP(300);
-			new_source_state = NEW_SOURCE_PHYS;
-
-			buf[0] = next_source;
-			buf[1] = CEC_MSG_GIVE_PHYSICAL_ADDRESS;
-			end = 1;
-			goto xmit;
-		}
+	BENCH_MARK(BENCH_TX_DONE);
+	return true;
+}
 
-	} else if (new_source_state == NEW_SOURCE_PING) {
-		new_source_timeout = MS_TO_LJIFFIES_UP(1000);
-		new_source_state = NEW_SOURCE_IDLE;
+/*
+ * Vendor command replies are longer than a queue slot, so they skip the
+ * queue and are built straight into the driver's transmit buffer. That is
+ * only free once the last frame is done and handled, cec_tv_process_cec_rx()
+ * holds the request until then.
+ */
+static bool cec_tx_direct_room(void)
+{
+	return !transmit_buf[0] && transmit_state < TRANSMIT_PEND;
+}
+
+/* Hand the len bytes in transmit_buf to the driver */
+static void cec_tx_start(unsigned char len, unsigned char done)
+{
+	transmit_buf_end = len - 1;
+	cec_tx_done = done;
+
+	DIAG_COUNT(cec_tx);
+	DIAG_EVENT(DIAG_EV_CEC_TX | (transmit_buf[0] & 0xf),
+			transmit_buf_end ? transmit_buf[1] : 0xff);
+	transmit_state = TRANSMIT_PEND;
+}
+
+/* Put the next queued frame on the bus */
+static bool cec_tv_periodic_cec_tx(void)
+{
+	struct cec_tx *tx;
+	unsigned char best;
+	unsigned char i;
+	bool handled;
+
+	handled = cec_tv_cec_tx_done();
+	handled |= cec_tv_cec_produce();
+
+	if (transmit_state >= TRANSMIT_PEND || !cec_tx_count)
+		return handled;
+
+	/* Most urgent class first, oldest first within a class */
+	best = 0;
+	for (i = 1; i < cec_tx_count; i++)
+		if (cec_txq[i].class < cec_txq[best].class)
+			best = i;
+
+	tx = cec_txq + best;
+	for (i = 0; i < tx->len; i++)
+		transmit_buf[i] = tx->buf[i];
+	cec_tx_start(tx->len, tx->done);
+	cec_tx_remove(best);
+	return true;
+}
+
+/* Byte i of the received frame, 0 is its length and error bits */
+static unsigned char cec_rx(unsigned char i)
+{
+	return cec_receive_buf[i];
+}
+
+/* True if the received vendor command ends in a good CRC16, see keymap.h */
+static bool cec_rx_vc_crc(unsigned char len)
+{
+	unsigned short crc = 0xffff;
+	unsigned char i;
+
+	if (len < 6)
+		return false;
+	for (i = 1; i <= len; i++)
+		crc = _crc16_update(crc, cec_rx(i));
+	return !crc;
+}
+
+/*
+ * False if the frame is a vendor command that must wait for transmit_buf,
+ * or for the EEPROM to finish a write before keymap reads
+ */
+static bool cec_rx_vc_room(unsigned char len)
+{
+	if (len < 2 || cec_rx(2) != CEC_MSG_VENDOR_COMMAND ||
+					!cec_addr_match(cec_rx(1) & 0xf))
+		return true;
+	return cec_tx_direct_room() && eeprom_is_ready();
+}
+
+/* Append the CRC16 to the first len bytes of a vendor command reply */
+static void cec_vc_crc(unsigned char *buf, unsigned char len)
+{
+	unsigned short crc = 0xffff;
+	unsigned char i;
 
-		buf[0] = next_source;
-		end = 0;
-		goto xmit;
+	/* Our address is 0, so buf[0] is the header as sent */
+	for (i = 0; i < len; i++)
+		crc = _crc16_update(crc, buf[i]);
+	buf[len] = crc;
+	buf[len + 1] = crc >> 8;
+}
+
+/*
+ * Bytes of a keymap write going into the EEPROM one at a time, straight
+ * from the received frame. It is held in cec_receive_buf until they are
+ * all in.
+ */
+static unsigned char keymap_wr_len;
+static unsigned char keymap_wr_pos;
+
+/* Answer a keymap vendor command with n bytes from addr, in transmit_buf */
+static void keymap_vc_reply(unsigned char source, unsigned char cmd,
+		unsigned char status, unsigned char addr, unsigned char n)
+{
+	unsigned char *buf = transmit_buf;
+	unsigned char i;
+
+	buf[0] = source;
+	buf[1] = CEC_MSG_VENDOR_COMMAND;
+	buf[2] = cmd | KEYMAP_VC_REPLY;
+	buf[3] = status;
+	buf[4] = addr;
+	for (i = 0; i < n; i++)
+		buf[5 + i] = keymap_byte(addr + i);
+
+	cec_vc_crc(buf, 5 + n);
+	cec_tx_start(7 + n, CEC_TX_DONE_NONE);
+}
+
+/* Keymap read/write vendor commands, false if this isn't one */
+static bool keymap_vc(unsigned char source, unsigned char len)
+{
+	unsigned char cmd = cec_rx(3);
+	unsigned char addr = cec_rx(4);
+	unsigned char n;
+
+	if (cmd == KEYMAP_VC_READ && len == 7)
+		n = cec_rx(5);
+	else if (cmd == KEYMAP_VC_WRITE)
+		n = len - 6;
+	else
+		return false;
+
+	if (!n || n > KEYMAP_VC_DATA || addr < KEYMAP_ADDR ||
+						addr + n > KEYMAP_END)
+		keymap_vc_reply(source, cmd, KEYMAP_VC_RANGE, addr, 0);
+	else if (cmd == KEYMAP_VC_READ)
+		keymap_vc_reply(source, cmd, KEYMAP_VC_OK, addr, n);
+	else {
+		keymap_wr_len = n;
+		keymap_wr_pos = 0;
 	}
+
 	return true;
+}
+
+/* Write the next byte of a keymap write, answer once they're all in */
+static void keymap_write_periodic(void)
+{
+	unsigned char *addr;
+	unsigned char val;
+
+	if (!keymap_wr_len || !eeprom_is_ready())
+		return;
+
+	if (keymap_wr_pos < keymap_wr_len) {
+		addr = (unsigned char *) (size_t) cec_rx(4) + keymap_wr_pos;
+		val = cec_rx(5 + keymap_wr_pos);
+		keymap_wr_pos++;
+
+		if (eeprom_read_byte(addr) != val) {
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				eeprom_write_byte(addr, val);
+			}
+		}
+		return;
+	}
+
+	if (!cec_tx_direct_room())
+		return;
+
+	keymap_vc_reply(cec_rx(1) >> 4, KEYMAP_VC_WRITE, KEYMAP_VC_OK,
+							cec_rx(4), 0);
+	keymap_wr_len = 0;
+	cec_receive_buf[0] = 0;
+
+	/* Pick up the new maps */
+	keymap_default_end = keymap_map(KEYMAP_DEFAULT, &keymap_default);
+	keymap_source = 0xff;
+}
+
+/* Answer a diagnostic vendor command with n bytes of block, in transmit_buf */
+static void diag_vc_reply(unsigned char source, unsigned char cmd,
+		unsigned char status, unsigned char block, unsigned char offset,
+		unsigned char n)
+{
+	unsigned char *buf = transmit_buf;
+	unsigned char size;
+
+	buf[0] = source;
+	buf[1] = CEC_MSG_VENDOR_COMMAND;
+	buf[2] = cmd | DIAG_VC_REPLY;
+	buf[3] = status;
+	buf[4] = block;
+	buf[5] = offset;
+	if (n) {
+		/* Interrupts update the timing block */
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			memcpy(buf + 6, diag_block(block, &size) + offset, n);
+		}
+	}
+	cec_vc_crc(buf, 6 + n);
+	cec_tx_start(8 + n, CEC_TX_DONE_NONE);
+}
+
+/* Diagnostic read/clear/dump vendor commands, false if this isn't one */
+static bool diag_vc(unsigned char source, unsigned char len)
+{
+	unsigned char cmd = cec_rx(3);
+	unsigned char block = cec_rx(4);
+	unsigned char offset = 0;
+	unsigned char n = 0;
+	unsigned char size;
+
+	if (cmd == DIAG_VC_READ && len == 8) {
+		offset = cec_rx(5);
+		n = cec_rx(6);
+	} else if ((cmd != DIAG_VC_CLEAR && cmd != DIAG_VC_DUMP) || len != 6)
+		return false;
+
+	if (!diag_block(block, &size) || offset >= size ||
+				(cmd == DIAG_VC_READ && (!n || n > DIAG_VC_DATA)))
+		diag_vc_reply(source, cmd, DIAG_VC_RANGE, block, offset, 0);
+	else if (cmd == DIAG_VC_READ) {
+		if (!offset)
+			diag_hold(block);
+		if (n > size - offset)
+			n = size - offset;
+		diag_vc_reply(source, cmd, DIAG_VC_OK, block, offset, n);
+	} else if (cmd == DIAG_VC_CLEAR) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			diag_clear(block);
+		}
+		diag_vc_reply(source, cmd, DIAG_VC_OK, block, 0, 0);
+	} else if (diag_dumping)
+		diag_vc_reply(source, cmd, DIAG_VC_BUSY, block, 0, 0);
+	else {
+		diag_hold(block);
+		diag_dump_block = block;
+		diag_dump_pos = 0;
+		diag_dumping = true;
+		diag_vc_reply(source, cmd, DIAG_VC_OK, block, 0, 0);
+	}
 
-xmit:
-	transmit_state = TRANSMIT_PEND;
-	transmit_buf_end = end;
 	return true;
 }
 
 /* Messages directly addressed to us */
 static void cec_tv_process_cec_rx_direct(unsigned char source, unsigned char len)
 {
-	switch (cec_receive_buf[2]) {
+	switch (cec_rx(2)) {
 	/* One Touch Play */
 	case CEC_MSG_IMAGE_VIEW_ON:
 	case CEC_MSG_TEXT_VIEW_ON:
 		/* Make sure TV is on */
 		if (tv_state < TV_POWER_UP)
-			tv_state = TV_POWER_UP;
+			cec_tv_power(TV_POWER_UP);
 		break;
 
 	/* Routing Control */
@@ -652,48 +1606,41 @@ static void cec_tv_process_cec_rx_direct(unsigned char source, unsigned char len
 		break;
 
 	case CEC_MSG_GET_MENU_LANGUAGE:
-		GPIOR1 |= _BV(FLAG1_MENU_LANG);
-		break;
-
 	case CEC_MSG_GIVE_PHYSICAL_ADDRESS:
-		GPIOR1 |= _BV(FLAG1_GIVE_PHYS);
+		cec_tv_reply(source, cec_rx(2));
 		break;
 
 	case CEC_MSG_FEATURE_ABORT:
 		break;
 
 	case CEC_MSG_VENDOR_COMMAND:
-		if (len == 16 && cec_receive_buf[16] == 0xb1) {
+		if (len == 16 && cec_rx(16) == 0xb1) {
 			/* Enter bootloader */
 			wdt_enable(0);
 			for(;;);
 		}
+		if (cec_rx_vc_crc(len) &&
+				(keymap_vc(source, len) || diag_vc(source, len)))
+			break;
 		/* Fall-through */
 
 	default:
 		/* Don't go any further if the initiator is unassigned */
-		if (source != CEC_ADDR_UNREGISTERED) {
-			unsigned char *buf;
-			buf = recv_pend + recv_pend_cnt;
-			recv_pend_cnt += 2;
-			*buf++ = source;
-			*buf++ = cec_receive_buf[2];
-		}
+		if (source != CEC_ADDR_UNREGISTERED)
+			cec_tv_reply(source, cec_rx(2));
 	}
 }
 
 /* Messages sent to the broadcast address */
 static void cec_tv_process_cec_rx_bcast(unsigned char source, unsigned char len)
 {
-	switch (cec_receive_buf[2]) {
+	switch (cec_rx(2)) {
 	case CEC_MSG_ROUTING_CHANGE:
 		/* bcast, Old physical address, new physical address */
 		/* CEC switch changed due to button press */
 
-		new_routing_phys = cec_receive_buf[6] |
-					(cec_receive_buf[5] << 8);
-		routing_change_timeout = MS_TO_LJIFFIES_UP(200);
-		GPIOR0 |= _BV(FLAG0_ROUTING_CHANGE);
+		new_routing_phys = cec_rx(6) | (cec_rx(5) << 8);
+		timer_set(TIMER_ROUTING_CHANGE, MS_TO_LJIFFIES_UP(200));
 		break;
 
 	case CEC_MSG_ROUTING_INFORMATION:
@@ -702,31 +1649,29 @@ static void cec_tv_process_cec_rx_bcast(unsigned char source, unsigned char len)
 		/* After routing change/routing formation is complete, set stream path */
 		/* Must wait 7 nominal data bit periods, up to 500ms  */
 
-		new_routing_phys = cec_receive_buf[4] |
-					(cec_receive_buf[3] << 8);
-		routing_change_timeout = MS_TO_LJIFFIES_UP(200);
-		GPIOR0 |= _BV(FLAG0_ROUTING_CHANGE);
+		new_routing_phys = cec_rx(4) | (cec_rx(3) << 8);
+		timer_set(TIMER_ROUTING_CHANGE, MS_TO_LJIFFIES_UP(200));
 		break;
 
 	case CEC_MSG_REPORT_PHYSICAL_ADDRESS:
 		/* Bcast, physical address, device type */
 		/* Store physical address of device */
-		/* May poll with CEC_MSG_GIVE_PHYSICAL_ADDRESS */
-		if (len < 5)
-			break;
-		if (next_source != source || new_source_state != NEW_SOURCE_PHYS)
+		if (len < 5 || !source || source == CEC_ADDR_BROADCAST)
 			break;
 
-		tv_logical_source = source;
-		GPIOR0 &= ~_BV(FLAG0_ROUTING_CHANGE);
+		/* Somebody new turned up by themselves, look for more */
+		if (!(source_present & (1 << source)) &&
+					!(source_known & (1 << source)))
+			cec_tv_sweep();
 
-		if (tv_state >= TV_POWER_UP) {
-			GPIOR0 |= _BV(FLAG0_SEND_PHYS_SOURCE_SER);
-			GPIOR0 |= _BV(FLAG0_SEND_PHYS_SOURCE_CEC);
-		}
+		cec_tv_dev_add(source, cec_rx(5))->phys =
+						cec_rx(4) | (cec_rx(3) << 8);
+		source_present |= 1 << source;
 
-		new_source_state = NEW_SOURCE_IDLE;
-		tv_phys_source = cec_receive_buf[4] | (cec_receive_buf[3] << 8);
+		if (new_source_state == NEW_SOURCE_WAIT) {
+			next_source = source - 1;
+			cec_tv_pick();
+		}
 		break;
 
 	case CEC_MSG_ACTIVE_SOURCE:
@@ -738,141 +1683,376 @@ static void cec_tv_process_cec_rx_bcast(unsigned char source, unsigned char len)
 
 		tv_logical_source = source;
 		GPIOR0 |= _BV(FLAG0_SEND_PHYS_SOURCE_SER);
-		GPIOR0 &= ~_BV(FLAG0_ROUTING_CHANGE);
+		timer_cancel(TIMER_ROUTING_CHANGE);
 		new_source_state = NEW_SOURCE_IDLE;
-		tv_phys_source = cec_receive_buf[4] | (cec_receive_buf[3] << 8);
+		tv_phys_source = cec_rx(4) | (cec_rx(3) << 8);
 
 		if (tv_state < TV_POWER_UP)
-			tv_state = TV_POWER_UP;
+			cec_tv_power(TV_POWER_UP);
 		break;
 	}
 }
 
-/* Process received CEC messages */
+/*
+ * Handle the frame in the driver's receive buffer. It stays there until
+ * it has been dealt with, and until then the driver nacks anything else
+ * sent to us, so the sender tries again instead of the frame being lost.
+ */
 static bool cec_tv_process_cec_rx(void)
 {
+	struct cec_tv_dev *dev;
 	unsigned char len;
 	unsigned char source;
 	unsigned char target;
 
-	len = cec_receive_buf[0];
-	cec_receive_buf[0] = 0;
-
-	if (!len)
+	len = cec_rx(0);
+	if (!len || keymap_wr_len)
 		return false;
 
 	/* Ignore packets with errors */
-	if (len & 0xc0)
-		return false;
+	if (len & 0xc0) {
+		DIAG_COUNT(cec_rx_error);
+		DIAG_EVENT(DIAG_EV_CEC_RX_ERROR, len);
+		goto done;
+	}
 
-	/* Buffer full, start dropping things */
-	if (recv_pend_cnt == sizeof(recv_pend))
+	/* No room for a reply, leave it for later */
+	if (!cec_tx_room(CEC_TX_REPLY) || !cec_rx_vc_room(len)) {
+		if (!(GPIOR0 & _BV(FLAG0_CEC_RX_HELD))) {
+			GPIOR0 |= _BV(FLAG0_CEC_RX_HELD);
+			DIAG_COUNT(cec_rx_held);
+		}
 		return false;
+	}
+	GPIOR0 &= ~_BV(FLAG0_CEC_RX_HELD);
 
-	source = cec_receive_buf[1] >> 4;
-	target = cec_receive_buf[1] & 0xf;
+	DIAG_COUNT(cec_rx);
+	DIAG_EVENT(DIAG_EV_CEC_RX | cec_rx(1) >> 4, len > 1 ? cec_rx(2) : 0xff);
+
+	source = cec_rx(1) >> 4;
+	target = cec_rx(1) & 0xf;
+
+	/* Ignore messages from us */
+	if (cec_addr_match(source))
+		goto done;
+
+	if (len >= 2) {
+		if (target == CEC_ADDR_BROADCAST)
+			cec_tv_process_cec_rx_bcast(source, len);
+		else if (cec_addr_match(target))
+			cec_tv_process_cec_rx_direct(source, len);
+	}
 
 	/* We now know this source is present */
 	source_present |= 1 << source;
+	dev = cec_tv_dev(source);
+	if (dev)
+		dev->seen = CEC_TV_NOW();
+
+done:
+	/* A keymap write keeps the frame until its bytes are in */
+	if (!keymap_wr_len)
+		cec_receive_buf[0] = 0;
+	return true;
+}
 
-	/* Ignore empty messages and messages from us */
-	if (len < 2 || cec_addr_match(source))
-		return false;
+/* We waited long enough for all routing changes messages, act on them */
+static void cec_tv_routing_change(void)
+{
+	if (tv_phys_source != new_routing_phys) {
+		tv_phys_source = new_routing_phys;
+		tv_logical_source = 0;
+		GPIOR0 |= _BV(FLAG0_SEND_PHYS_SOURCE_SER);
+		cec_tv_stream_path();
+	}
 
-	if (target == CEC_ADDR_BROADCAST)
-		cec_tv_process_cec_rx_bcast(source, len);
-	else if (cec_addr_match(target))
-		cec_tv_process_cec_rx_direct(source, len);
+	new_source_state = NEW_SOURCE_IDLE;
+}
 
-	return true;
+/*
+ * Snapshot of the active source and the device table, kept in EEPROM above
+ * the keymap so a power cycle doesn't start from nothing. The snapshot
+ * goes into the next of PERSIST_SLOTS slots each time it changes, spreading
+ * the wear, and a slot whose write was cut short fails its check so the
+ * previous one is used instead. Each slot holds
+ *
+ * 0	check, PERSIST_SEED plus the sum of the other bytes
+ * 1	sequence number, one more than the previous slot's
+ * 2	active logical address
+ * 3-4	active physical address
+ * 5-13	three devices, (logical << 4 | type), physical address
+ *
+ * Unused device slots are 0xff. The snapshot is compared with the current
+ * state every PERSIST_MS. A changed snapshot is written a byte per pass so
+ * nothing stalls the main loop, and unchanged bytes are never erased. The
+ * old check is spoilt first, so the slot's previous contents can't vouch
+ * for a half written one, and the new check, summed from the bytes as they
+ * are written, goes in last.
+ */
+#define PERSIST_ADDR	KEYMAP_END
+#define PERSIST_SLOTS	4
+#define PERSIST_DEVS	3
+#define PERSIST_LEN	(5 + PERSIST_DEVS * 3)
+#define PERSIST_SEED	0xa5
+#define PERSIST_MS	10000
+
+/* Spoiling the old check is the first step of a write */
+#define PERSIST_SPOIL	0xff
+
+/* Next byte of persist_slot to write, 0 when idle */
+static unsigned char persist_pos;
+static unsigned char persist_slot;
+static unsigned char persist_seq;
+static unsigned char persist_check;
+
+static unsigned char *cec_tv_persist_addr(unsigned char slot, unsigned char i)
+{
+	return (unsigned char *) PERSIST_ADDR + slot * PERSIST_LEN + i;
+}
+
+/* Byte i of the snapshot of the current state, i > 1 */
+static unsigned char cec_tv_persist_byte(unsigned char i)
+{
+	struct cec_tv_dev *dev = cec_tv_devs;
+
+	if (i == 2)
+		return tv_logical_source;
+	if (i == 3)
+		return tv_phys_source >> 8;
+	if (i == 4)
+		return tv_phys_source;
+
+	/* Find the device for this slot */
+	i -= 5;
+	for (;; dev++) {
+		if (dev == cec_tv_devs + CEC_TV_DEVS)
+			return 0xff;
+		if (!dev->id)
+			continue;
+		if (i < 3)
+			break;
+		i -= 3;
+	}
+
+	if (i == 0)
+		return dev->id;
+	if (i == 1)
+		return dev->phys >> 8;
+	return dev->phys;
 }
 
-CEC_TV_PUBLIC void cec_tv_periodic(unsigned char delta_long)
+/* Start writing a new slot if the state moved on from the current one */
+static void cec_tv_persist(void)
 {
 	unsigned char i;
 
-	/* Update timeouts */
-	for (i = 0; i < sizeof(timeouts); i++) {
-		if (timeouts[i] >= 0)
-			timeouts[i] -= delta_long;
-	}
-
-	/* Check for nacks/acks */
-	if (transmit_buf[0] && transmit_state < TRANSMIT_PEND) {
-		unsigned char target = transmit_buf[0] & 0xf;
-		if (transmit_state == TRANSMIT_FAILED) {
-			/* This source clearly isn't there */
-			source_present &= ~(1 << target);
-			if (target == tv_logical_source)
-				/* It was our active source, pick a new one */
-				new_source_state = NEW_SOURCE_PICK;
-		} else
-			source_present |= 1 << target;
-		transmit_buf[0] = 0;
+	/* A busy EEPROM would stall the compare, look again shortly */
+	if (!eeprom_is_ready()) {
+		timer_set(TIMER_PERSIST, 1);
 		return;
 	}
 
-	/* We waited long enough for all routing changes messages, act on them */
-	if (routing_change_timeout < 0 && (GPIOR0 & _BV(FLAG0_ROUTING_CHANGE))) {
-		GPIOR0 &= ~_BV(FLAG0_ROUTING_CHANGE);
+	timer_set(TIMER_PERSIST, MS_TO_LJIFFIES_UP(PERSIST_MS));
+	if (persist_pos)
+		return;
 
-		if (tv_phys_source != new_routing_phys) {
-			tv_phys_source = new_routing_phys;
-			tv_logical_source = 0;
-			GPIOR0 |= _BV(FLAG0_SEND_PHYS_SOURCE_SER);
-			GPIOR0 |= _BV(FLAG0_SEND_PHYS_SOURCE_CEC);
-		}
+	for (i = 2; i < PERSIST_LEN; i++)
+		if (eeprom_read_byte(cec_tv_persist_addr(persist_slot, i)) !=
+						cec_tv_persist_byte(i))
+			break;
+	if (i == PERSIST_LEN)
+		return;
 
-		new_source_state = NEW_SOURCE_IDLE;
+	if (++persist_slot == PERSIST_SLOTS)
+		persist_slot = 0;
+	persist_seq++;
+	persist_check = PERSIST_SEED;
+	persist_pos = PERSIST_SPOIL;
+}
+
+/* Write one byte of the new slot if the EEPROM is free */
+static void cec_tv_persist_periodic(void)
+{
+	unsigned char *addr;
+	unsigned char val;
+
+	if (!persist_pos || !eeprom_is_ready())
 		return;
+
+	if (persist_pos == PERSIST_SPOIL) {
+		addr = cec_tv_persist_addr(persist_slot, 0);
+		val = ~eeprom_read_byte(addr);
+		persist_pos = 1;
+	} else if (persist_pos == PERSIST_LEN) {
+		addr = cec_tv_persist_addr(persist_slot, 0);
+		val = persist_check;
+		persist_pos = 0;
+	} else {
+		addr = cec_tv_persist_addr(persist_slot, persist_pos);
+		val = persist_pos == 1 ? persist_seq :
+					cec_tv_persist_byte(persist_pos);
+		persist_check += val;
+		persist_pos++;
 	}
 
-	if (new_source_timeout < 0) {
-		/* Advance the new source state machine */
-		if (new_source_state == NEW_SOURCE_PHYS) {
-			/* Our query never came back */
-			new_source_state = NEW_SOURCE_LOGICAL;
-			source_present &= ~(1 << next_source);
-		} else if (new_source_state == NEW_SOURCE_IDLE) {
-			next_source++;
-			if (next_source == CEC_ADDR_BROADCAST)
-				next_source = 1;
-			new_source_state = NEW_SOURCE_PING;
+	if (eeprom_read_byte(addr) != val) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			eeprom_write_byte(addr, val);
 		}
 	}
+}
+
+/*
+ * Restore the newest good snapshot. Restored devices count as present
+ * until the boot sweep, which polls every address, says otherwise.
+ */
+CEC_TV_PUBLIC void cec_tv_init(void)
+{
+	unsigned char buf[PERSIST_LEN];
+	unsigned char check;
+	bool found = false;
+	unsigned char slot;
+	unsigned char i;
+
+	/* With none, the first snapshot goes into slot 0 */
+	persist_slot = PERSIST_SLOTS - 1;
+
+	for (slot = 0; slot < PERSIST_SLOTS; slot++) {
+		check = PERSIST_SEED;
+		for (i = 0; i < PERSIST_LEN; i++) {
+			buf[i] = eeprom_read_byte(cec_tv_persist_addr(slot, i));
+			if (i)
+				check += buf[i];
+		}
+
+		if (check != buf[0] || (found &&
+				(signed char) (buf[1] - persist_seq) <= 0))
+			continue;
+
+		found = true;
+		persist_slot = slot;
+		persist_seq = buf[1];
+	}
+
+	if (found) {
+		for (i = 0; i < PERSIST_LEN; i++)
+			buf[i] = eeprom_read_byte(
+					cec_tv_persist_addr(persist_slot, i));
+
+		for (i = 5; i < PERSIST_LEN; i += 3) {
+			unsigned char addr = buf[i] >> 4;
+
+			if (!addr || addr >= CEC_ADDR_BROADCAST)
+				continue;
+			cec_tv_dev_add(addr, buf[i])->phys =
+						buf[i + 1] << 8 | buf[i + 2];
+			source_present |= 1 << addr;
+		}
+
+		if (buf[2] && buf[2] < CEC_ADDR_BROADCAST) {
+			tv_logical_source = buf[2];
+			tv_phys_source = buf[3] << 8 | buf[4];
+			GPIOR0 |= _BV(FLAG0_RESTORED);
+		}
+	}
+
+	timer_set(TIMER_PERSIST, MS_TO_LJIFFIES_UP(PERSIST_MS));
+
+	keymap_default_end = keymap_map(KEYMAP_DEFAULT, &keymap_default);
+}
+
+const timer_cb_t timer_callbacks[TIMER_NR] PROGMEM = {
+	[TIMER_PERSIST] = cec_tv_persist,
+	[TIMER_SWEEP] = cec_tv_sweep_timer,
+	[TIMER_ROUTING_CHANGE] = cec_tv_routing_change,
+	[TIMER_LG_REPLY] = lg_reply_timeout,
+};
+
+/* Returns false if there was nothing to do */
+CEC_TV_PUBLIC bool cec_tv_periodic(unsigned char delta_long)
+{
+	unsigned char events = 0;
+	unsigned char handled;
+
+	BENCH_MARK(BENCH_ENTER);
+
+	timer_advance(delta_long);
 
 	if (new_source_state == NEW_SOURCE_PICK) {
-		/* Restart the new source state machine */
+		/* Move on from the current source */
 		next_source = tv_logical_source;
 		tv_logical_source = 0;
-		new_source_state = NEW_SOURCE_LOGICAL;
+		if (!cec_tv_pick()) {
+			new_source_state = NEW_SOURCE_WAIT;
+			cec_tv_sweep();
+		}
 	}
 
-	/* Check for complete message from TV */
-	if (serial_resp) {
-		lg_response();
-		serial_resp = 0;
-		return;
-	}
+	CEC_TV_DEPTH(CEC_TV_SRC_SERIAL_RX, usi_uart_rx_count() +
+			!!(GPIOR0 & _BV(FLAG0_LG_RESPONSE)));
+	CEC_TV_DEPTH(CEC_TV_SRC_IR, ir_nec_events);
+	CEC_TV_DEPTH(CEC_TV_SRC_CEC_RX, !!cec_receive_buf[0]);
+	CEC_TV_DEPTH(CEC_TV_SRC_SERIAL_TX, USI_UART_TX_SIZE - 1 - usi_uart_tx_free());
+	CEC_TV_DEPTH(CEC_TV_SRC_CEC_TX, cec_tx_count);
 
-	/* Handle received serial bytes */
-	if (usi_uart_process_byte())
-		return;
+	/*
+	 * Give each source one event per round, in priority order, until
+	 * nobody has anything left or the budget runs out.
+	 */
+	do {
+		handled = 0;
+
+		/* Check for complete message from TV */
+		if (GPIOR0 & _BV(FLAG0_LG_RESPONSE)) {
+			GPIOR0 &= ~_BV(FLAG0_LG_RESPONSE);
+			lg_response();
+			BENCH_MARK(BENCH_SERIAL_RESP);
+			handled++;
+		}
 
-	/* Handle received IR button presses */
-	if (ir_nec_press_periodic())
-		return;
+		/* Handle received serial bytes */
+		if (usi_uart_process_byte()) {
+			BENCH_MARK(BENCH_SERIAL_RX);
+			handled++;
+		}
 
-	/* Handle incoming CEC messages */
-	if (cec_tv_process_cec_rx())
-		return;
+		/* Handle received IR button presses */
+		if (ir_nec_press_periodic()) {
+			BENCH_MARK(BENCH_IR);
+			handled++;
+		}
 
-	/* Handle any events that require us to send serial bytes */
-	if (cec_tv_periodic_serial_tx())
-		return;
+		/* Handle incoming CEC messages */
+		if (cec_tv_process_cec_rx()) {
+			BENCH_MARK(BENCH_CEC_RX);
+			handled++;
+		}
 
-	/* Handle any events that require us to send CEC messages */
-	if (cec_tv_periodic_cec_tx())
-		return;
+		/* Handle any events that require us to send serial bytes */
+		if (cec_tv_periodic_serial_tx()) {
+			BENCH_MARK(BENCH_SERIAL_TX);
+			handled++;
+		}
+
+		/* Handle any events that require us to send CEC messages */
+		if (cec_tv_periodic_cec_tx()) {
+			BENCH_MARK(BENCH_CEC_TX);
+			handled++;
+		}
+
+		events += handled;
+	} while (handled && events < CEC_TV_BUDGET);
+
+	cec_tv_persist_periodic();
+	keymap_write_periodic();
+
+	/* Have the new source's keys ready before the next press */
+	if (keymap_source != tv_logical_source && eeprom_is_ready())
+		keymap_load();
+
+	cec_tv_trace();
+
+	BENCH_MARK(BENCH_IDLE);
+	return events;
 }
 
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <util/atomic.h>
+
+#include "usi_uart.h"
+#include "ir_nec.h"
+#include "diag.h"
+
+#ifdef DIAG_TIMING
+struct diag_timing diag_timing;
+
+/* TCNT0 as __vector_1 and __vector_14 started */
+unsigned char diag_int0_start;
+unsigned char diag_usi_start;
+
+/* The C side of DIAG_ISR_END, for longer runs */
+DIAG_PUBLIC void diag_time(struct diag_isr *rec, unsigned short ticks)
+{
+	unsigned long sum;
+
+	if (ticks > rec->max)
+		rec->max = ticks;
+
+	sum = rec->sum[0] | (unsigned short) rec->sum[1] << 8 |
+					(unsigned long) rec->sum[2] << 16;
+	sum += ticks;
+	if (++rec->count & 0x8000 || sum & 0x800000) {
+		rec->count >>= 1;
+		sum >>= 1;
+	}
+	rec->sum[0] = sum;
+	rec->sum[1] = sum >> 8;
+	rec->sum[2] = sum >> 16;
+}
+
+DIAG_PUBLIC void diag_loop(unsigned short ticks)
+{
+	struct diag_timing *t = &diag_timing;
+	unsigned short n = ticks >> 7;
+	unsigned char b;
+
+	/* 0 is a cleared minimum, no pass is that short */
+	if (!t->loop_min || ticks < t->loop_min)
+		t->loop_min = ticks;
+	if (ticks > t->loop_max)
+		t->loop_max = ticks;
+
+	for (b = 0; n && b < DIAG_HIST - 1; b++)
+		n >>= 1;
+	if (t->loop_hist[b] != 0xffff)
+		t->loop_hist[b]++;
+}
+#endif
+
+#ifdef DIAG_COUNTERS
+struct diag_counters diag_counters;
+
+static void diag_add(unsigned char *count, unsigned char n)
+{
+	n += *count;
+	*count = n < *count ? 0xff : n;
+}
+
+DIAG_PUBLIC void diag_periodic(void)
+{
+	unsigned char ser_rx, edges;
+	bool overflow;
+
+	if (!ser_rx_overrun && !ir_nec_edge_overrun && !ser_overflow)
+		return;
+
+	/* The interrupts only count up to 255, move them over */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ser_rx = ser_rx_overrun;
+		ser_rx_overrun = 0;
+		edges = ir_nec_edge_overrun;
+		ir_nec_edge_overrun = 0;
+		overflow = ser_overflow;
+		ser_overflow = false;
+	}
+
+	diag_add(&diag_counters.ser_rx_drop, ser_rx);
+	diag_add(&diag_counters.ir_edge_drop, edges);
+	if (overflow)
+		DIAG_COUNT(ser_overflow);
+}
+#endif
+
+#ifdef DIAG_TRACE
+struct diag_trace diag_trace;
+unsigned long diag_trace_now;
+static unsigned long diag_trace_last;
+static bool diag_trace_held;
+
+DIAG_PUBLIC void diag_trace_add(unsigned char event, unsigned char arg)
+{
+	struct diag_trace *t = &diag_trace;
+	unsigned long ticks;
+
+	if (diag_trace_held)
+		return;
+
+	/* Keep the remainder so the deltas don't drift */
+	ticks = (diag_trace_now - diag_trace_last) >> DIAG_TRACE_SHIFT;
+	if (!t->used)
+		ticks = 0;
+	if (!t->used || ticks > 0xffff) {
+		diag_trace_last = diag_trace_now;
+		if (ticks > 0xffff)
+			ticks = 0xffff;
+	} else
+		diag_trace_last += ticks << DIAG_TRACE_SHIFT;
+
+	t->rec[t->next].delta = ticks;
+	t->rec[t->next].event = event;
+	t->rec[t->next].arg = arg;
+	if (++t->next == DIAG_TRACE_LEN)
+		t->next = 0;
+	if (t->used < DIAG_TRACE_LEN)
+		t->used++;
+}
+#endif
+
+DIAG_PUBLIC unsigned char *diag_block(unsigned char block, unsigned char *size)
+{
+	switch (block) {
+#ifdef DIAG_COUNTERS
+	case DIAG_BLOCK_COUNTERS:
+		*size = sizeof(diag_counters);
+		return (unsigned char *) &diag_counters;
+#endif
+#ifdef DIAG_TIMING
+	case DIAG_BLOCK_TIMING:
+		*size = sizeof(diag_timing);
+		return (unsigned char *) &diag_timing;
+#endif
+#ifdef DIAG_TRACE
+	case DIAG_BLOCK_TRACE:
+		*size = sizeof(diag_trace);
+		return (unsigned char *) &diag_trace;
+#endif
+	default:
+		*size = 0;
+		return NULL;
+	}
+}
+
+/* Start a block over, interrupts must be off */
+DIAG_PUBLIC void diag_clear(unsigned char block)
+{
+	unsigned char *p;
+	unsigned char size;
+
+	p = diag_block(block, &size);
+	if (p)
+		memset(p, 0, size);
+#ifdef DIAG_TRACE
+	if (block == DIAG_BLOCK_TRACE)
+		diag_trace_held = false;
+#endif
+}
+
+DIAG_PUBLIC void diag_hold(unsigned char block)
+{
+#ifdef DIAG_TRACE
+	if (block == DIAG_BLOCK_TRACE)
+		diag_trace_held = true;
+#endif
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DIAG_H_
+#define _DIAG_H_
+
+/*
+ * Diagnostic blocks in RAM can be read with vendor commands addressed to
+ * the TV:
+ *
+ *	<hdr> 0x89 DIAG_VC_READ <block> <offset> <n> <crc16>
+ *	<hdr> 0x89 DIAG_VC_CLEAR <block> <crc16>
+ *	<hdr> 0x89 DIAG_VC_DUMP <block> <crc16>
+ *
+ * each answered with
+ *
+ *	<hdr> 0x89 <cmd | DIAG_VC_REPLY> <status> <block> <offset> <bytes> <crc16>
+ *
+ * n is 1 to DIAG_VC_DATA, reads past the end of the block are cut short.
+ * A block that isn't built in is answered with DIAG_VC_RANGE. The CRC16
+ * is the one the keymap commands use, see keymap.h.
+ *
+ * DIAG_VC_DUMP also writes the block out of the LG serial port, between
+ * commands to the TV, as lines of hex in the shape of an LG command:
+ *
+ *	zz 01 <block><offset><bytes>\r
+ *
+ * with as many bytes per line as the serial transmit ring holds.
+ */
+#define DIAG_VC_READ		0x44
+#define DIAG_VC_CLEAR		0x45
+#define DIAG_VC_DUMP		0x46
+#define DIAG_VC_REPLY		0x80
+#define DIAG_VC_DATA		8
+
+#define DIAG_VC_OK		0x00
+#define DIAG_VC_RANGE		0x01
+#define DIAG_VC_BUSY		0x02
+
+/*
+ * DIAG_BLOCK_TIMING, built with -DDIAG_TIMING. Times are in Timer0 ticks
+ * (8 CPU cycles), multi-byte fields are little endian:
+ *
+ *	0	__vector_1 (INT0)		struct diag_isr
+ *	7	__vector_14 (USI overflow)	struct diag_isr
+ *	14	cec_periodic() in the main loop
+ *	21	shortest main loop period	2 bytes
+ *	23	longest main loop period	2 bytes
+ *	25	main loop periods by length	8 x 2 bytes
+ *
+ * A struct diag_isr is a 2 byte count of runs, the 3 byte sum of their
+ * ticks and the 2 byte longest run. Count and sum are both halved before
+ * either overflows, sum / count stays the mean. Interrupt times are from
+ * the first to the last instruction of the handler and include any handler
+ * nested in it, entry and exit add about 3 ticks.
+ *
+ * The loop period is from one pass of the main loop to the next, sleep
+ * included, which is the most a polled event waits. Histogram bucket 0
+ * counts periods of under 128 ticks, bucket n < 7 those under 128 << n and
+ * bucket 7 the rest. Histogram counts saturate at 0xffff.
+ */
+#define DIAG_BLOCK_TIMING	0
+
+/*
+ * DIAG_BLOCK_COUNTERS, built with -DDIAG_COUNTERS. Event counts since power
+ * up or the last clear, each saturating rather than wrapping:
+ *
+ *	0	CEC frames put on the bus		2 bytes
+ *	2	CEC frames acked			2 bytes
+ *	4	CEC frames nacked or given up on	2 bytes
+ *	6	CEC frames received			2 bytes
+ *	8	IR repeats				2 bytes
+ *	10	CEC frames dropped from a full queue	1 byte
+ *	11	CEC frames received with errors		1 byte
+ *	12	CEC frames held with no room to reply	1 byte
+ *	13	late __vector_14, serial bits lost	1 byte
+ *	14	serial bytes lost to a full ring	1 byte
+ *	15	IR frames that failed to decode		1 byte
+ *	16	IR edges lost to a full FIFO		1 byte
+ *	17	IR events lost to a full queue		1 byte
+ *	18	NG replies from the TV			1 byte
+ *	19	TV commands given up without a reply	1 byte
+ *
+ * NG replies to the power query only mean the TV is off and aren't
+ * counted.
+ */
+#define DIAG_BLOCK_COUNTERS	1
+
+/*
+ * DIAG_BLOCK_TRACE, built with -DDIAG_TRACE. The last DIAG_TRACE_LEN
+ * events of the main loop:
+ *
+ *	0	next record to write		1 byte
+ *	1	records written, up to DIAG_TRACE_LEN	1 byte
+ *	2	records				DIAG_TRACE_LEN x 4 bytes
+ *
+ * each record being
+ *
+ *	<delta> <event> <arg>
+ *
+ * where delta is 2 bytes of time since the record before it in units of
+ * 1 << DIAG_TRACE_SHIFT jiffies (128us), 0xffff if longer. Events are
+ * timed by the start of the main loop pass they happen in. Reading offset
+ * 0 or dumping the block stops the trace so the rest of it can be read in
+ * pieces, clearing it starts it over. diag_trace.py decodes it.
+ */
+#define DIAG_BLOCK_TRACE	2
+
+#ifndef DIAG_TRACE_LEN
+#define DIAG_TRACE_LEN		16
+#endif
+#define DIAG_TRACE_SHIFT	8
+
+/* arg is the new enum tv_state */
+#define DIAG_EV_TV_STATE	0x01
+/* arg is the logical address of the new active source */
+#define DIAG_EV_SOURCE		0x02
+/* arg is the first nibble of the new physical address to show */
+#define DIAG_EV_INPUT		0x03
+/* arg is the second letter of the LG command put on the wire */
+#define DIAG_EV_LG_TX		0x04
+/* arg is the letter of the LG reply */
+#define DIAG_EV_LG_OK		0x05
+#define DIAG_EV_LG_NG		0x06
+/* arg is a data byte of the LG reply, before its DIAG_EV_LG_OK/NG */
+#define DIAG_EV_LG_DATA		0x0a
+/* arg is the command of the remote key */
+#define DIAG_EV_IR_PRESS	0x07
+#define DIAG_EV_IR_RELEASE	0x08
+/* arg is the status byte from the driver */
+#define DIAG_EV_CEC_RX_ERROR	0x09
+/* Low nibble is the other address, arg is the opcode, 0xff for a poll */
+#define DIAG_EV_CEC_RX		0x10
+#define DIAG_EV_CEC_TX		0x20
+#define DIAG_EV_CEC_ACK		0x30
+#define DIAG_EV_CEC_NACK	0x40
+
+#define DIAG_ISR_COUNT		0
+#define DIAG_ISR_SUM		2
+#define DIAG_ISR_MAX		5
+#define DIAG_ISR_SIZE		7
+
+/* Record offsets, kept free of spaces for assembler macro arguments */
+#define DIAG_TIMING_INT0	0
+#define DIAG_TIMING_USI		DIAG_ISR_SIZE
+
+#define DIAG_HIST		8
+
+#ifdef __ASSEMBLER__
+
+#ifdef DIAG_TIMING
+
+/* Note TCNT0 as a handler starts, reg is free to clobber */
+.macro DIAG_ISR_START start, reg
+	in \reg, TCNT0
+	sts \start, \reg
+.endm
+
+/*
+ * Charge the ticks since DIAG_ISR_START to the record at rec, tot is the
+ * Timer0 period. Needs SREG saved, clobbers r24 and r25.
+ */
+.macro DIAG_ISR_END rec, start, tot
+	/* r24 = (TCNT0 - start) mod tot */
+	in r24, TCNT0
+	lds r25, \start
+	sub r24, r25
+	brcc 1f
+	subi r24, -\tot
+
+	/* if (ticks > max) max = ticks, ticks < tot so max < 256 */
+1:	lds r25, \rec + DIAG_ISR_MAX
+	cp r25, r24
+	brsh 1f
+	sts \rec + DIAG_ISR_MAX, r24
+
+	/* sum += ticks */
+1:	lds r25, \rec + DIAG_ISR_SUM
+	add r25, r24
+	sts \rec + DIAG_ISR_SUM, r25
+	brcc 1f
+	lds r25, \rec + DIAG_ISR_SUM + 1
+	inc r25
+	sts \rec + DIAG_ISR_SUM + 1, r25
+	brne 1f
+	lds r25, \rec + DIAG_ISR_SUM + 2
+	inc r25
+	sts \rec + DIAG_ISR_SUM + 2, r25
+
+	/* if (++count & 0x8000) count >>= 1, sum >>= 1 */
+1:	lds r24, \rec + DIAG_ISR_COUNT
+	lds r25, \rec + DIAG_ISR_COUNT + 1
+	adiw r24, 1
+	brpl 2f
+	lsr r25
+	ror r24
+	sts \rec + DIAG_ISR_COUNT, r24
+	sts \rec + DIAG_ISR_COUNT + 1, r25
+	lds r24, \rec + DIAG_ISR_SUM + 2
+	lsr r24
+	sts \rec + DIAG_ISR_SUM + 2, r24
+	lds r24, \rec + DIAG_ISR_SUM + 1
+	ror r24
+	sts \rec + DIAG_ISR_SUM + 1, r24
+	lds r24, \rec + DIAG_ISR_SUM
+	ror r24
+	sts \rec + DIAG_ISR_SUM, r24
+	rjmp 3f
+2:	sts \rec + DIAG_ISR_COUNT, r24
+	sts \rec + DIAG_ISR_COUNT + 1, r25
+3:
+.endm
+
+#else
+
+.macro DIAG_ISR_START start, reg
+.endm
+
+.macro DIAG_ISR_END rec, start, tot
+.endm
+
+#endif
+
+#else
+
+#include <stdbool.h>
+
+#ifndef DIAG_PUBLIC
+#define DIAG_PUBLIC
+#endif
+
+/* Packed for the host build too, the layout is read over the wire */
+struct diag_isr {
+	unsigned short count;
+	unsigned char sum[3];
+	unsigned short max;
+} __attribute__((packed));
+
+struct diag_timing {
+	struct diag_isr int0;
+	struct diag_isr usi;
+	struct diag_isr cec_rx;
+	unsigned short loop_min;
+	unsigned short loop_max;
+	unsigned short loop_hist[DIAG_HIST];
+} __attribute__((packed));
+
+struct diag_counters {
+	unsigned short cec_tx;
+	unsigned short cec_tx_ack;
+	unsigned short cec_tx_nack;
+	unsigned short cec_rx;
+	unsigned short ir_repeat;
+	unsigned char cec_tx_drop;
+	unsigned char cec_rx_error;
+	unsigned char cec_rx_held;
+	unsigned char ser_overflow;
+	unsigned char ser_rx_drop;
+	unsigned char ir_error;
+	unsigned char ir_edge_drop;
+	unsigned char ir_event_drop;
+	unsigned char lg_ng;
+	unsigned char lg_timeout;
+} __attribute__((packed));
+
+#ifdef DIAG_COUNTERS
+extern struct diag_counters diag_counters;
+
+/* Pick up the counts __vector_1 and __vector_14 keep */
+DIAG_PUBLIC void diag_periodic(void);
+
+/* Saturating diag_counters.name++ */
+#define DIAG_COUNT(name) do {					\
+	if (!++diag_counters.name)				\
+		diag_counters.name--;				\
+} while (0)
+#define DIAG_PERIODIC()		diag_periodic()
+#else
+#define DIAG_COUNT(name)	do {} while (0)
+#define DIAG_PERIODIC()		do {} while (0)
+#endif
+
+struct diag_trace {
+	unsigned char next;
+	unsigned char used;
+	struct {
+		unsigned short delta;
+		unsigned char event;
+		unsigned char arg;
+	} __attribute__((packed)) rec[DIAG_TRACE_LEN];
+} __attribute__((packed));
+
+#ifdef DIAG_TRACE
+extern struct diag_trace diag_trace;
+
+/* Start of the current main loop pass */
+extern unsigned long diag_trace_now;
+
+DIAG_PUBLIC void diag_trace_add(unsigned char event, unsigned char arg);
+
+#define DIAG_TRACE_TIME(j)	do { diag_trace_now = (j); } while (0)
+#define DIAG_EVENT(event, arg)	diag_trace_add(event, arg)
+#else
+#define DIAG_TRACE_TIME(j)	do {} while (0)
+#define DIAG_EVENT(event, arg)	do {} while (0)
+#endif
+
+#ifdef DIAG_TIMING
+/* Updated by __vector_1 and __vector_14 as well as the main loop */
+extern struct diag_timing diag_timing;
+
+DIAG_PUBLIC void diag_time(struct diag_isr *rec, unsigned short ticks);
+DIAG_PUBLIC void diag_loop(unsigned short ticks);
+
+#define DIAG_CEC_RX(since) \
+	diag_time(&diag_timing.cec_rx, jiffies16() - (unsigned short) (since))
+#define DIAG_LOOP(ticks)	diag_loop(ticks)
+#else
+#define DIAG_CEC_RX(since)	do {} while (0)
+#define DIAG_LOOP(ticks)	do {} while (0)
+#endif
+
+/* Block id to RAM, NULL if it isn't built in */
+DIAG_PUBLIC unsigned char *diag_block(unsigned char block, unsigned char *size);
+DIAG_PUBLIC void diag_clear(unsigned char block);
+
+/* Stop a block changing while it is read out */
+DIAG_PUBLIC void diag_hold(unsigned char block);
+
+#endif
+
+#endif
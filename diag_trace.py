@@ -0,0 +1,225 @@
+#!/usr/bin/python
+#
+# Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Trace decoder.
+#
+# Prints the trace block in diag.h (built with -DDIAG_TRACE) as a timeline,
+# with the time each step took and a summary of how long input switches
+# took from the event that started them to the TV taking the xb command.
+#
+# With no arguments the trace is read from a running device with the diag
+# vendor commands and cleared afterwards, which starts it over. Otherwise
+# the "zz 01 02..." lines of a serial dump are taken from the named file,
+# or from stdin for "-".
+
+import re
+import sys
+import struct
+
+DIAG_VC_READ = 0x44
+DIAG_VC_CLEAR = 0x45
+DIAG_VC_REPLY = 0x80
+DIAG_VC_DATA = 8
+
+DIAG_VC_OK = 0x00
+DIAG_VC_RANGE = 0x01
+
+DIAG_BLOCK_TRACE = 2
+
+# A delta is 1 << DIAG_TRACE_SHIFT jiffies of 8 CPU cycles
+F_CPU = 15974400
+DIAG_TRACE_SHIFT = 8
+UNIT_MS = (1 << DIAG_TRACE_SHIFT) * 8 * 1000.0 / F_CPU
+
+TV_STATES = ['off', 'power off', 'powering off', 'power up', 'powering up',
+             'on']
+
+LG_CMDS = {'a': 'ka power', 'b': 'xb input', 'c': 'mc key', 'e': 'ke mute',
+           'f': 'kf volume', 'm': 'km power query', 'x': 'dx picture mode'}
+
+CEC_OPCODES = {
+    0x00: 'feature abort', 0x04: 'image view on', 0x0d: 'text view on',
+    0x1a: 'give deck status', 0x1b: 'deck status', 0x32: 'set menu language',
+    0x36: 'standby', 0x41: 'play', 0x42: 'deck control',
+    0x44: 'user control pressed', 0x45: 'user control released',
+    0x46: 'give osd name', 0x47: 'set osd name', 0x80: 'routing change',
+    0x81: 'routing information', 0x82: 'active source',
+    0x83: 'give physical address', 0x84: 'report physical address',
+    0x85: 'request active source', 0x86: 'set stream path',
+    0x87: 'device vendor id', 0x89: 'vendor command',
+    0x8c: 'give device vendor id', 0x8f: 'give device power status',
+    0x90: 'report power status', 0x91: 'get menu language',
+    0x9d: 'inactive source', 0x9e: 'cec version', 0x9f: 'get cec version',
+    0xff: 'poll',
+}
+
+# Events that ask for an input switch
+SWITCH_OPCODES = (0x04, 0x0d, 0x80, 0x82, 0x86)
+
+def read_cec():
+    import cec
+    import crcmod
+
+    crc16 = crcmod.mkCrcFun(0x18005, 0xffff)
+
+    class diag_dev(cec.device):
+        def __init__(self, idx=0):
+            super(diag_dev, self).__init__(idx)
+            self.logical_addresses(1 << 0xf)
+            self.read(timeout_ms=1)
+
+        def tx_done(self, status):
+            self.response = status
+
+        def receive_msg(self, msg, length, status):
+            msg = msg[:length]
+            if len(msg) < 8 or (ord(msg[0]) >> 4) != 0 or ord(msg[1]) != 0x89:
+                return
+            if crc16(msg):
+                return
+            self.reply = msg
+
+        def cmd(self, cmd, b):
+            b = struct.pack('<BBB', 0xf0, 0x89, cmd) + b
+            b += struct.pack('<H', crc16(b))
+
+            retries = 10
+            while retries:
+                retries -= 1
+                self.reply = None
+                self.response = None
+                self.write(b)
+                while self.response is None:
+                    self.read()
+                if not self.response:
+                    continue
+
+                for i in range(10):
+                    if self.reply is not None:
+                        break
+                    self.read(timeout_ms=50)
+
+                r = self.reply
+                if r is None or ord(r[2]) != cmd | DIAG_VC_REPLY:
+                    continue
+                status = ord(r[3])
+                if status == DIAG_VC_RANGE:
+                    return None
+                if status != DIAG_VC_OK:
+                    raise Exception('Diag command 0x%02x failed: %d' % (cmd, status))
+                return r[6:-2]
+
+            raise Exception('No answer to diag command 0x%02x' % cmd)
+
+    dev = diag_dev()
+
+    # Reading offset 0 holds the trace until the clear
+    data = ''
+    while True:
+        b = dev.cmd(DIAG_VC_READ, struct.pack('<BBB', DIAG_BLOCK_TRACE,
+                                              len(data), DIAG_VC_DATA))
+        if b is None:
+            break
+        data += b
+        if len(b) < DIAG_VC_DATA:
+            break
+    if not data:
+        raise Exception('Device was built without -DDIAG_TRACE')
+    dev.cmd(DIAG_VC_CLEAR, struct.pack('<B', DIAG_BLOCK_TRACE))
+    return bytearray(data)
+
+def read_dump(f):
+    chunks = {}
+    for line in f:
+        m = re.search(r'zz 01 ((?:[0-9a-f]{2})+)', line)
+        if not m:
+            continue
+        b = bytearray.fromhex(m.group(1))
+        if b[0] == DIAG_BLOCK_TRACE:
+            chunks[b[1]] = b[2:]
+
+    data = bytearray()
+    for offset in sorted(chunks):
+        if offset != len(data):
+            raise Exception('Dump is missing bytes at offset %d' % len(data))
+        data += chunks[offset]
+    if not data:
+        raise Exception('No trace in the dump')
+    return data
+
+def records(data):
+    nxt, used = data[0], data[1]
+    n = (len(data) - 2) // 4
+    recs = [struct.unpack('<HBB', bytes(data[2 + i * 4:6 + i * 4]))
+            for i in range(n)]
+    if used == n:
+        return recs[nxt:] + recs[:nxt]
+    return recs[:used]
+
+def describe(event, arg):
+    if event == 0x01:
+        if arg < len(TV_STATES):
+            return 'tv state %s' % TV_STATES[arg]
+        return 'tv state %d' % arg
+    if event == 0x02:
+        return 'active source %x' % arg
+    if event == 0x03:
+        return 'input %d.0.0.0' % arg
+    if event in (0x04, 0x05, 0x06):
+        cmd = LG_CMDS.get(chr(arg), repr(chr(arg)))
+        return {0x04: 'lg >', 0x05: 'lg < OK', 0x06: 'lg < NG'}[event] + ' ' + cmd
+    if event == 0x07:
+        return 'ir press %02x' % arg
+    if event == 0x08:
+        return 'ir release %02x' % arg
+    if event == 0x09:
+        return 'cec rx error, status %02x' % arg
+    if event == 0x0a:
+        return 'lg < data %02x' % arg
+    kind = {0x10: 'cec rx from', 0x20: 'cec tx to', 0x30: 'cec tx ok to',
+            0x40: 'cec tx nack to'}.get(event & 0xf0)
+    if kind:
+        return '%s %x: %s' % (kind, event & 0xf,
+                              CEC_OPCODES.get(arg, '%02x' % arg))
+    return 'event %02x %02x' % (event, arg)
+
+def starts_switch(event, arg):
+    return event == 0x07 or (event & 0xf0 == 0x10 and arg in SWITCH_OPCODES)
+
+if len(sys.argv) > 1:
+    data = read_dump(sys.stdin if sys.argv[1] == '-' else open(sys.argv[1]))
+else:
+    data = read_cec()
+
+t = 0.0
+start = None
+switches = []
+print('%10s %9s  %s' % ('ms', 'step', 'event'))
+for delta, event, arg in records(data):
+    step = delta * UNIT_MS
+    t += step
+    desc = describe(event, arg)
+    print('%10.2f %s%8.2f  %s' % (t, '>' if delta == 0xffff else ' ', step, desc))
+
+    if starts_switch(event, arg) and start is None:
+        start = (t, desc)
+    elif event == 0x05 and chr(arg) == 'b' and start is not None:
+        switches.append((start[1], t - start[0]))
+        start = None
+
+for desc, ms in switches:
+    print('%s: input switched after %.1f ms' % (desc, ms))
@@ -30,19 +30,13 @@ int main(void)
 	sei();
 
 	for (;;) {
-		unsigned char byte;
-again:
-		wdt_reset();
-
-		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-			if (!ser_recv_ready)
-				goto again;
+		int c;
 
-			byte = ser_recv_byte;
-			ser_recv_ready = false;
-		}
+		wdt_reset();
 
-		usi_uart_put(byte);
+		c = usi_uart_getc();
+		if (c >= 0)
+			usi_uart_put(c);
 	}
 
 	return 0;
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host stand-in for the avr-cec driver. main.c includes this in place of
+ * avr-cec/cec.c when building for the host. The bus itself, and everyone
+ * else on it, is modelled by host/cec_bus.c.
+ */
+
+#include "cec.h"
+
+volatile unsigned char transmit_state;
+unsigned char transmit_buf[CEC_MAX_LEN];
+unsigned char transmit_buf_end;
+volatile unsigned char cec_receive_buf[CEC_MAX_LEN + 1];
+
+CEC_PUBLIC bool cec_addr_match(unsigned char addr)
+{
+	return addr == CEC_FIXED_LOGICAL_ADDRESS;
+}
+
+CEC_PUBLIC void cec_init(void)
+{
+}
+
+CEC_PUBLIC void cec_periodic(unsigned int delta_short)
+{
+	(void) delta_short;
+}
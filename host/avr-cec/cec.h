@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host stand-in for the avr-cec driver interface. The bus model in
+ * host/cec_bus.c takes frames from transmit_buf and fills
+ * cec_receive_buf the same way the AVR driver does:
+ *
+ * cec_receive_buf[0]: length of the frame including the header byte, with
+ *                     error bits in the top two bits. Zero when free.
+ * cec_receive_buf[1...]: header, opcode, operands
+ *
+ * transmit_buf[0 ... transmit_buf_end]: destination, opcode, operands.
+ * Setting transmit_state to TRANSMIT_PEND starts a transmit, the driver
+ * drops it to TRANSMIT_OK or TRANSMIT_FAILED once the frame is done.
+ */
+
+#ifndef _HOST_CEC_H_
+#define _HOST_CEC_H_
+
+#include <stdbool.h>
+
+#ifndef CEC_PUBLIC
+#define CEC_PUBLIC
+#endif
+
+#define CEC_MAX_LEN		16
+
+#define CEC_RX_NACK		0x80
+#define CEC_RX_OVERRUN		0x40
+
+enum transmit_state {
+	TRANSMIT_OK,
+	TRANSMIT_FAILED,
+	TRANSMIT_PEND,
+	TRANSMIT_BUSY,
+};
+
+extern volatile unsigned char transmit_state;
+extern unsigned char transmit_buf[CEC_MAX_LEN];
+extern unsigned char transmit_buf_end;
+extern volatile unsigned char cec_receive_buf[CEC_MAX_LEN + 1];
+
+CEC_PUBLIC bool cec_addr_match(unsigned char addr);
+CEC_PUBLIC void cec_init(void);
+CEC_PUBLIC void cec_periodic(unsigned int delta_short);
+
+#endif
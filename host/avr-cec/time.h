@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host stand-in for avr-cec/time.h. Units are identical to the AVR build:
+ * a jiffy is one Timer/Counter0 tick and a long jiffy is 1 << LJIFFIES_SHIFT
+ * jiffies, sized so that LONG_TIME_S fits in a signed char.
+ */
+
+#ifndef _HOST_TIME_H_
+#define _HOST_TIME_H_
+
+#define TCNT0_PRESCALER		8
+#define TCNT0_PRESCALER_VAL	_BV(CS01)
+
+#define JIFFIES_HZ		(F_CPU / TCNT0_PRESCALER)
+#define LJIFFIES_SHIFT		15
+#define LJIFFIES_HZ		((double) JIFFIES_HZ / (1UL << LJIFFIES_SHIFT))
+
+#define HZ_TO_JIFFIES_RND(hz)	((JIFFIES_HZ + (hz) / 2) / (hz))
+#define NS_TO_JIFFIES_RND(ns)	\
+	(((ns) * JIFFIES_HZ + 500000000ULL) / 1000000000ULL)
+#define MS_TO_JIFFIES_RND(ms)	NS_TO_JIFFIES_RND((ms) * 1000000ULL)
+#define MS_TO_LJIFFIES_UP(ms)	\
+	((long) ((ms) * LJIFFIES_HZ / 1000 + 0.999999))
+
+typedef unsigned int __uint24;
+
+/* Provided by host/usi_uart_isr.c as it is by usi_uart_isr.S */
+__uint24 jiffies(void);
+
+#endif
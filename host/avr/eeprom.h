@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HOST_AVR_EEPROM_H_
+#define _HOST_AVR_EEPROM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avr/io.h>
+
+/* host.c models the write time, and the wait a busy EEPROM costs */
+bool host_eeprom_ready(void);
+void host_eeprom_wait(void);
+void host_eeprom_written(void);
+
+static inline bool eeprom_is_ready(void)
+{
+	return host_eeprom_ready();
+}
+
+#define eeprom_busy_wait() do {} while (!eeprom_is_ready())
+
+static inline uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+	host_eeprom_wait();
+	return host_eeprom[(uintptr_t) addr & E2END];
+}
+
+static inline void eeprom_write_byte(uint8_t *addr, uint8_t val)
+{
+	host_eeprom_wait();
+	host_eeprom[(uintptr_t) addr & E2END] = val;
+	host_eeprom_written();
+}
+
+static inline void eeprom_update_byte(uint8_t *addr, uint8_t val)
+{
+	eeprom_write_byte(addr, val);
+}
+
+#endif
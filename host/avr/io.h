@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host stand-in for the ATtiny45 I/O registers. Registers are plain
+ * variables so that the firmware state machines can run unmodified on a
+ * Linux box. EEDR reads straight from the simulated EEPROM at EEAR, which
+ * is all the firmware does with it.
+ */
+
+#ifndef _HOST_AVR_IO_H_
+#define _HOST_AVR_IO_H_
+
+#include <stdint.h>
+
+#ifndef _BV
+#define _BV(bit)	(1 << (bit))
+#endif
+
+#define bit_is_set(sfr, bit)	((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit)	(!((sfr) & _BV(bit)))
+
+#define E2END		0xff
+#define RAMEND		0x15f
+#define SPM_PAGESIZE	64
+
+extern volatile uint8_t GPIOR0;
+extern volatile uint8_t GPIOR1;
+extern volatile uint8_t GPIOR2;
+
+extern volatile uint16_t EEAR;
+extern volatile uint8_t EECR;
+extern uint8_t host_eeprom[E2END + 1];
+#define EEDR		host_eeprom[EEAR & E2END]
+
+extern volatile uint8_t PINB;
+extern volatile uint8_t PORTB;
+extern volatile uint8_t DDRB;
+extern volatile uint8_t MCUCR;
+extern volatile uint8_t MCUSR;
+extern volatile uint8_t GIMSK;
+extern volatile uint8_t PCMSK;
+extern volatile uint8_t OSCCAL;
+
+extern volatile uint8_t USICR;
+extern volatile uint8_t USISR;
+extern volatile uint8_t USIDR;
+extern volatile uint8_t USIBR;
+
+extern volatile uint8_t TCCR0A;
+extern volatile uint8_t TCCR0B;
+extern volatile uint8_t TCNT0;
+extern volatile uint8_t OCR0A;
+
+/* PORTB */
+#define PB0		0
+#define PB1		1
+#define PB2		2
+#define PB3		3
+#define PB4		4
+#define PB5		5
+
+/* EECR */
+#define EERE		0
+#define EEPE		1
+#define EEMPE		2
+
+/* MCUCR */
+#define ISC00		0
+#define ISC01		1
+#define SM0		3
+#define SM1		4
+#define SE		5
+
+/* GIMSK */
+#define PCIE		5
+#define INT0		6
+
+/* PCMSK */
+#define PCINT3		3
+
+/* USICR */
+#define USICS0		2
+#define USICS1		3
+#define USIWM0		4
+#define USIWM1		5
+#define USIOIE		6
+
+/* USISR */
+#define USIOIF		6
+
+/* TCCR0A/TCCR0B */
+#define WGM01		1
+#define CS00		0
+#define CS01		1
+#define CS02		2
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HOST_AVR_PGMSPACE_H_
+#define _HOST_AVR_PGMSPACE_H_
+
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s)			(s)
+#define memcpy_P		memcpy
+#define pgm_read_byte(addr)	(*(const unsigned char *) (addr))
+#define pgm_read_word(addr)	(*(const unsigned short *) (addr))
+#define pgm_read_ptr(addr)	(*(void * const *) (addr))
+
+#endif
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HOST_AVR_SLEEP_H_
+#define _HOST_AVR_SLEEP_H_
+
+#include <avr/io.h>
+
+/*
+ * The host harness advances time one USI overflow per main loop pass, so
+ * sleeping until the next interrupt is the same as not sleeping.
+ */
+#define SLEEP_MODE_IDLE		0
+
+#define set_sleep_mode(mode)	do {} while (0)
+#define sleep_enable()		do {} while (0)
+#define sleep_disable()		do {} while (0)
+#define sleep_cpu()		do {} while (0)
+
+#endif
@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host model of the CEC bus.
+ *
+ * The bus carries one frame at a time. A frame occupies the bus for the
+ * start bit plus ten bit periods per byte, or just the header block if the
+ * header isn't acked. Before starting a frame an initiator waits for the
+ * signal free time: 3 bit periods to send another frame after its own, 5
+ * as a new initiator and 7 for a retransmission. Initiators that become
+ * ready during the same pass arbitrate on the header byte, the lowest
+ * header wins and the rest wait for the bus to go free again.
+ *
+ * The firmware is the node at CEC_ADDR_TV, it transmits through
+ * transmit_buf/transmit_state and receives through cec_receive_buf, just as
+ * with the avr-cec driver. A directed frame to the TV is nacked while
+ * cec_receive_buf is still holding the last frame, and a broadcast arriving
+ * then is lost. Simulated devices occupy the other logical addresses and
+ * answer the usual queries after reply_ms.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cec.h"
+#include "cec_spec.h"
+#include "time.h"
+#include "host.h"
+
+#define CEC_START_JIFFIES	HOST_MS_TO_JIFFIES(4.5)
+#define CEC_BIT_JIFFIES		HOST_MS_TO_JIFFIES(2.4)
+
+/* Signal free times, in bit periods */
+#define CEC_SFT_RETRY		3
+#define CEC_SFT_NEW		5
+#define CEC_SFT_NEXT		7
+
+/* Retransmissions after a nack for simulated devices */
+#define CEC_DEV_RETRIES		2
+
+#define CEC_DEV_TXQ		16
+
+struct cec_frame {
+	unsigned long long when;
+	unsigned char len;
+	unsigned char retries;
+	unsigned char buf[CEC_MAX_LEN];
+};
+
+struct cec_dev {
+	bool exists;
+	bool present;
+	bool active;
+	unsigned short phys;
+	unsigned char type;
+	unsigned int reply_ms;
+
+	struct cec_frame txq[CEC_DEV_TXQ];
+	unsigned char txq_head;
+	unsigned char txq_tail;
+};
+
+/* The last entry only queues frames injected from the unregistered address */
+static struct cec_dev cec_devs[CEC_ADDR_UNREGISTERED + 1];
+
+static struct cec_frame cec_bus_frame;
+static unsigned char cec_bus_initiator;
+static bool cec_bus_busy;
+static bool cec_bus_ack;
+static unsigned long long cec_bus_free;
+static unsigned char cec_bus_last = CEC_ADDR_BROADCAST;
+
+/* The firmware's retry state, it is only ever a new frame */
+static unsigned char cec_tv_retries;
+
+static void cec_log(const struct cec_frame *frame, const char *status)
+{
+	char str[CEC_MAX_LEN * 3 + 1];
+	unsigned char i;
+
+	for (i = 0; i < frame->len; i++)
+		sprintf(str + i * 3, "%02x%s", frame->buf[i],
+						i == frame->len - 1 ? "" : ":");
+	host_log("cec", "%s%s", str, status);
+}
+
+static const char *cec_phys_str(unsigned short phys)
+{
+	static char str[8];
+
+	sprintf(str, "%x.%x.%x.%x", phys >> 12, (phys >> 8) & 0xf,
+						(phys >> 4) & 0xf, phys & 0xf);
+	return str;
+}
+
+static struct cec_dev *cec_dev_get(unsigned char addr)
+{
+	if (addr == CEC_ADDR_TV || addr >= CEC_ADDR_BROADCAST ||
+						!cec_devs[addr].exists) {
+		fprintf(stderr, "No simulated device at %x\n", addr);
+		return NULL;
+	}
+	return cec_devs + addr;
+}
+
+/* Queue a frame from a simulated device, delay_ms from now */
+static void cec_dev_send(unsigned char addr, unsigned char target,
+			unsigned int delay_ms, unsigned char len, ...)
+{
+	struct cec_dev *dev = cec_devs + addr;
+	struct cec_frame *frame;
+	va_list ap;
+	unsigned char i;
+
+	if ((unsigned char) (dev->txq_head - dev->txq_tail) >= CEC_DEV_TXQ)
+		return;
+
+	frame = dev->txq + dev->txq_head++ % CEC_DEV_TXQ;
+	frame->when = host_jiffies + HOST_MS_TO_JIFFIES(delay_ms);
+	frame->len = len + 1;
+	frame->retries = 0;
+	frame->buf[0] = addr << 4 | target;
+	va_start(ap, len);
+	for (i = 0; i < len; i++)
+		frame->buf[i + 1] = va_arg(ap, int);
+	va_end(ap);
+}
+
+static void cec_dev_active_source(unsigned char addr)
+{
+	struct cec_dev *dev = cec_devs + addr;
+	unsigned char i;
+
+	for (i = 0; i < CEC_ADDR_BROADCAST; i++)
+		cec_devs[i].active = false;
+	dev->active = true;
+	cec_dev_send(addr, CEC_ADDR_BROADCAST, dev->reply_ms, 3,
+			CEC_MSG_ACTIVE_SOURCE, dev->phys >> 8, dev->phys & 0xff);
+}
+
+/* A simulated device sees a complete, acked frame */
+static void cec_dev_receive(unsigned char addr, const struct cec_frame *frame)
+{
+	struct cec_dev *dev = cec_devs + addr;
+	unsigned char source = frame->buf[0] >> 4;
+	unsigned short phys;
+
+	if (frame->len < 2)
+		return;
+
+	phys = frame->buf[2] << 8 | frame->buf[3];
+
+	switch (frame->buf[1]) {
+	case CEC_MSG_GIVE_PHYSICAL_ADDRESS:
+		cec_dev_send(addr, CEC_ADDR_BROADCAST, dev->reply_ms, 4,
+				CEC_MSG_REPORT_PHYSICAL_ADDRESS,
+				dev->phys >> 8, dev->phys & 0xff, dev->type);
+		break;
+
+	case CEC_MSG_GIVE_DEVICE_POWER_STATUS:
+		cec_dev_send(addr, source, dev->reply_ms, 2,
+			CEC_MSG_REPORT_POWER_STATUS, CEC_MSG_POWER_STATUS_ON);
+		break;
+
+	case CEC_MSG_SET_STREAM_PATH:
+		if (frame->len >= 4 && phys == dev->phys && !dev->active)
+			cec_dev_active_source(addr);
+		break;
+
+	case CEC_MSG_ACTIVE_SOURCE:
+		if (frame->len >= 4 && phys != dev->phys)
+			dev->active = false;
+		break;
+
+	case CEC_MSG_USER_CONTROL_PRESSED:
+		if (frame->len >= 3)
+			host_log("dev", "%x key %02x pressed", addr,
+								frame->buf[2]);
+		break;
+
+	case CEC_MSG_USER_CONTROL_RELEASED:
+		host_log("dev", "%x key released", addr);
+		break;
+	}
+}
+
+void host_cec_device(unsigned char addr, unsigned short phys,
+				unsigned char type, unsigned int reply_ms)
+{
+	struct cec_dev *dev;
+
+	if (addr == CEC_ADDR_TV || addr >= CEC_ADDR_BROADCAST)
+		return;
+
+	dev = cec_devs + addr;
+	memset(dev, 0, sizeof(*dev));
+	dev->exists = true;
+	dev->present = true;
+	dev->phys = phys;
+	dev->type = type;
+	dev->reply_ms = reply_ms;
+	host_log("dev", "%x at %s", addr, cec_phys_str(phys));
+}
+
+void host_cec_plug(unsigned char addr, bool present)
+{
+	struct cec_dev *dev = cec_dev_get(addr);
+
+	if (!dev)
+		return;
+
+	dev->present = present;
+	dev->active = false;
+	dev->txq_tail = dev->txq_head;
+	host_log("dev", "%x %s", addr, present ? "plugged in" : "unplugged");
+
+	/* Announce ourselves on hotplug */
+	if (present)
+		cec_dev_send(addr, CEC_ADDR_BROADCAST, dev->reply_ms, 4,
+				CEC_MSG_REPORT_PHYSICAL_ADDRESS,
+				dev->phys >> 8, dev->phys & 0xff, dev->type);
+}
+
+/* One touch play */
+void host_cec_play(unsigned char addr)
+{
+	struct cec_dev *dev = cec_dev_get(addr);
+
+	if (!dev)
+		return;
+
+	cec_dev_send(addr, CEC_ADDR_TV, 0, 1, CEC_MSG_IMAGE_VIEW_ON);
+	cec_dev_active_source(addr);
+}
+
+void host_cec_standby(unsigned char addr)
+{
+	struct cec_dev *dev = cec_dev_get(addr);
+
+	if (!dev)
+		return;
+
+	if (dev->active)
+		cec_dev_send(addr, CEC_ADDR_TV, 0, 3, CEC_MSG_INACTIVE_SOURCE,
+					dev->phys >> 8, dev->phys & 0xff);
+	dev->active = false;
+}
+
+/* Switch at addr changes its input */
+void host_cec_routing(unsigned char addr, unsigned short from,
+							unsigned short to)
+{
+	if (!cec_dev_get(addr))
+		return;
+
+	cec_dev_send(addr, CEC_ADDR_BROADCAST, 0, 5, CEC_MSG_ROUTING_CHANGE,
+			from >> 8, from & 0xff, to >> 8, to & 0xff);
+}
+
+/* Switch at addr reports the path it is now routing */
+void host_cec_routing_info(unsigned char addr, unsigned short phys)
+{
+	if (!cec_dev_get(addr))
+		return;
+
+	cec_dev_send(addr, CEC_ADDR_BROADCAST, 0, 3,
+			CEC_MSG_ROUTING_INFORMATION, phys >> 8, phys & 0xff);
+}
+
+/* Raw frame from a simulated device, or from nobody in particular */
+bool host_cec_inject(const unsigned char *buf, unsigned char len)
+{
+	struct cec_dev *dev = cec_devs + (buf[0] >> 4);
+	struct cec_frame *frame;
+
+	if (!len || len > CEC_MAX_LEN ||
+		(unsigned char) (dev->txq_head - dev->txq_tail) >= CEC_DEV_TXQ)
+		return false;
+
+	frame = dev->txq + dev->txq_head++ % CEC_DEV_TXQ;
+	frame->when = host_jiffies;
+	frame->len = len;
+	frame->retries = 0;
+	memcpy(frame->buf, buf, len);
+	return true;
+}
+
+/* Does anyone ack this frame? */
+static bool cec_bus_acked(const struct cec_frame *frame)
+{
+	unsigned char target = frame->buf[0] & 0xf;
+
+	/* Broadcasts are acked unless someone objects, nobody does here */
+	if (target == CEC_ADDR_BROADCAST)
+		return true;
+
+	if (target == CEC_ADDR_TV)
+		return !cec_receive_buf[0];
+
+	return cec_devs[target].exists && cec_devs[target].present;
+}
+
+static void cec_bus_done(void)
+{
+	const struct cec_frame *frame = &cec_bus_frame;
+	unsigned char target = frame->buf[0] & 0xf;
+	struct cec_dev *dev;
+	unsigned char i;
+
+	cec_bus_busy = false;
+	cec_bus_last = cec_bus_initiator;
+	host_events++;
+
+	if (cec_bus_initiator == CEC_ADDR_TV) {
+		cec_log(frame, cec_bus_ack ? "" : " nack");
+		transmit_state = cec_bus_ack ? TRANSMIT_OK : TRANSMIT_FAILED;
+		if (cec_bus_ack && frame->len >= 4 &&
+				frame->buf[1] == CEC_MSG_SET_STREAM_PATH)
+			host_switch_event("set stream path %s",
+				cec_phys_str(frame->buf[2] << 8 | frame->buf[3]));
+	} else {
+		dev = cec_devs + cec_bus_initiator;
+		if (cec_bus_ack || dev->txq[dev->txq_tail % CEC_DEV_TXQ].retries++ ==
+							CEC_DEV_RETRIES) {
+			cec_log(frame, cec_bus_ack ? "" : " nack");
+			dev->txq_tail++;
+		} else
+			cec_log(frame, " nack, retrying");
+	}
+
+	if (!cec_bus_ack)
+		return;
+
+	for (i = 1; i < CEC_ADDR_BROADCAST; i++) {
+		if (i == cec_bus_initiator || !cec_devs[i].exists ||
+							!cec_devs[i].present)
+			continue;
+		if (target == i || target == CEC_ADDR_BROADCAST)
+			cec_dev_receive(i, frame);
+	}
+
+	if (cec_bus_initiator == CEC_ADDR_TV)
+		return;
+
+	if (target == CEC_ADDR_TV ||
+			(target == CEC_ADDR_BROADCAST && !cec_receive_buf[0])) {
+		cec_receive_buf[0] = frame->len;
+		memcpy((void *) cec_receive_buf + 1, frame->buf, frame->len);
+	} else if (target == CEC_ADDR_BROADCAST)
+		host_log("cec", "broadcast lost, receive buffer busy");
+}
+
+/* Signal free time before addr may start a frame */
+static unsigned long long cec_bus_sft(unsigned char addr, bool retry)
+{
+	unsigned char bits;
+
+	if (retry)
+		bits = CEC_SFT_RETRY;
+	else if (addr == cec_bus_last)
+		bits = CEC_SFT_NEXT;
+	else
+		bits = CEC_SFT_NEW;
+
+	return cec_bus_free + bits * CEC_BIT_JIFFIES;
+}
+
+void host_cec_advance(void)
+{
+	struct cec_frame *frame, *best = NULL;
+	unsigned char i, best_addr = 0;
+	struct cec_dev *dev;
+
+	if (cec_bus_busy) {
+		if (host_jiffies < cec_bus_free)
+			return;
+		cec_bus_done();
+	}
+
+	/* Gather everyone who may start now, lowest header wins */
+	if (transmit_state == TRANSMIT_PEND &&
+			host_jiffies >= cec_bus_sft(CEC_ADDR_TV, cec_tv_retries)) {
+		frame = &cec_bus_frame;
+		frame->len = transmit_buf_end + 1;
+		memcpy(frame->buf, transmit_buf, frame->len);
+		frame->buf[0] = CEC_ADDR_TV << 4 |
+							(transmit_buf[0] & 0xf);
+		best = frame;
+		best_addr = CEC_ADDR_TV;
+	}
+
+	for (i = 1; i <= CEC_ADDR_UNREGISTERED; i++) {
+		dev = cec_devs + i;
+		if (dev->txq_head == dev->txq_tail)
+			continue;
+		frame = dev->txq + dev->txq_tail % CEC_DEV_TXQ;
+		if (host_jiffies < frame->when ||
+				host_jiffies < cec_bus_sft(i, frame->retries))
+			continue;
+		if (best && best->buf[0] <= frame->buf[0]) {
+			host_log("cec", "%x lost arbitration", i);
+			continue;
+		}
+		if (best)
+			host_log("cec", "%x lost arbitration", best_addr);
+		best = frame;
+		best_addr = i;
+	}
+
+	if (!best)
+		return;
+
+	if (best != &cec_bus_frame)
+		cec_bus_frame = *best;
+	if (best_addr == CEC_ADDR_TV)
+		transmit_state = TRANSMIT_BUSY;
+
+	cec_bus_initiator = best_addr;
+	cec_bus_ack = cec_bus_acked(&cec_bus_frame);
+	cec_bus_busy = true;
+	cec_bus_free = host_jiffies + CEC_START_JIFFIES +
+		(cec_bus_ack ? cec_bus_frame.len : 1) * 10 * CEC_BIT_JIFFIES;
+}
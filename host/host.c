@@ -0,0 +1,492 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host harness for the firmware. Runs main.c against the register, EEPROM
+ * and jiffies shims, driven by a script read from a file or stdin:
+ *
+ * run <ms>			Let the firmware run for <ms> of simulated time
+ * ir <code> [hold ms]		Press a remote key (LG code in hex, NEC
+ *				address 4), optionally holding it
+ * remote <protocol> <address> <code> [hold ms]
+ *				Press a key on another remote, protocol is one
+ *				of nec, necx, sirc, rc5 or rc6
+ * serial <text>		Bytes from the TV
+ * tv on|off			Force the TV power state
+ * cec <hex> <hex> ...		A frame appears on the CEC bus, sent by the
+ *				address in the header
+ * device <addr> <phys> <type> [reply ms]
+ *				Add a simulated CEC device, type is one of
+ *				record, tuner, playback, audio or switch
+ * plug <addr>, unplug <addr>	Connect or disconnect a device
+ * play <addr>			One touch play from a device
+ * standby <addr>		A device goes to standby
+ * routing <addr> <from> <to>	A switch changes inputs
+ * routinginfo <addr> <phys>	A switch reports its active path
+ * mark <label>			Start timing, the next input switch by the
+ *				firmware is reported against <label>
+ * bench <count>		Replay <count> key presses, CEC frames and
+ *				serial replies as fast as possible and report
+ *				simulated events per second
+ *
+ * Output is a timeline of everything the firmware sends and receives,
+ * stamped with simulated milliseconds, followed by a time-to-switch line for
+ * each mark. Physical addresses are written as 1.0.0.0.
+ */
+
+#include <avr/io.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "time.h"
+#include "host.h"
+#include "keymap.h"
+
+/* Just for the protocol numbers */
+#undef IR_NEC_PUBLIC
+#define IR_NEC_PUBLIC
+#include "ir_nec.h"
+
+/* For the counters printed on exit */
+#undef DIAG_PUBLIC
+#define DIAG_PUBLIC
+#include "diag.h"
+
+volatile uint8_t GPIOR0;
+volatile uint8_t GPIOR1;
+volatile uint8_t GPIOR2;
+volatile uint16_t EEAR;
+volatile uint8_t EECR;
+volatile uint8_t PINB = _BV(PB2) | _BV(PB3);
+volatile uint8_t PORTB;
+volatile uint8_t DDRB;
+volatile uint8_t MCUCR;
+volatile uint8_t MCUSR;
+volatile uint8_t GIMSK;
+volatile uint8_t PCMSK;
+volatile uint8_t OSCCAL;
+volatile uint8_t USICR;
+volatile uint8_t USISR;
+volatile uint8_t USIDR;
+volatile uint8_t USIBR;
+volatile uint8_t TCCR0A;
+volatile uint8_t TCCR0B;
+volatile uint8_t TCNT0;
+volatile uint8_t OCR0A;
+
+uint8_t host_eeprom[E2END + 1];
+
+unsigned long long host_jiffies;
+unsigned long host_events;
+bool host_verbose = true;
+
+/* lg_cec_keymap.c packed the way keymap.hex is */
+int keymap_pack(unsigned char *buf, int size);
+
+int firmware_main(void);
+
+static FILE *host_script;
+
+/* EEPROM image kept across runs, like a unit being power cycled */
+static const char *host_eeprom_file;
+
+/* A byte write keeps the EEPROM busy this long */
+#define HOST_EEPROM_WRITE_MS	3.4
+
+/* When the last write is done, and how often the firmware had to wait */
+static unsigned long long host_eeprom_busy;
+static unsigned int host_eeprom_waits;
+static unsigned long long host_run_until;
+
+void host_log(const char *who, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!host_verbose)
+		return;
+
+	printf("%10.3f %-4s ", HOST_JIFFIES_TO_MS(host_jiffies), who);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+}
+
+bool host_eeprom_ready(void)
+{
+	return host_jiffies >= host_eeprom_busy;
+}
+
+/* Accessing a busy EEPROM spins until the write is done */
+void host_eeprom_wait(void)
+{
+	if (host_eeprom_ready())
+		return;
+
+	host_log("eep", "waited %.3f ms for a write",
+			HOST_JIFFIES_TO_MS(host_eeprom_busy - host_jiffies));
+	host_eeprom_waits++;
+	host_jiffies = host_eeprom_busy;
+}
+
+void host_eeprom_written(void)
+{
+	host_eeprom_busy = host_jiffies + HOST_MS_TO_JIFFIES(HOST_EEPROM_WRITE_MS);
+}
+
+void host_wdt_reset(void)
+{
+	host_log("wdt", "reset into bootloader");
+	exit(0);
+}
+
+static void host_script_next(void);
+
+/* Benchmark state */
+static bool host_bench_running;
+static unsigned long host_bench_left;
+static unsigned long host_bench_events;
+static unsigned long long host_bench_sim;
+static struct timespec host_bench_start;
+
+static void host_bench_next(void)
+{
+	static const unsigned char frames[][4] = {
+		{ 0x4f, 0x82, 0x10, 0x00 },	/* Active source 1.0.0.0 */
+		{ 0x80, 0x8f },			/* Give power status */
+		{ 0x8f, 0x82, 0x20, 0x00 },	/* Active source 2.0.0.0 */
+		{ 0x40, 0x9f },			/* Get CEC version */
+	};
+	struct timespec end;
+	unsigned long events;
+	double secs, sim_ms;
+
+	if (host_bench_left) {
+		host_bench_left--;
+		host_ir_press(IR_NEC, 4, host_bench_left & 1 ? 0x02 : 0x44, 0);
+		host_cec_inject(frames[host_bench_left % 4],
+						host_bench_left & 1 ? 2 : 4);
+		host_uart_send("m 01 OK00x", 10);
+		host_run_until = host_jiffies + HOST_MS_TO_JIFFIES(200);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = end.tv_sec - host_bench_start.tv_sec +
+			(end.tv_nsec - host_bench_start.tv_nsec) / 1e9;
+	sim_ms = HOST_JIFFIES_TO_MS(host_jiffies - host_bench_sim);
+	events = host_events - host_bench_events;
+	host_verbose = true;
+	host_bench_running = false;
+
+	host_log("host", "bench: %lu events in %.0f simulated ms, "
+		"%.3f s wall, %.0f events/s, %.0fx real time", events,
+		sim_ms, secs, events / secs, sim_ms / 1000 / secs);
+
+	host_script_next();
+}
+
+static void host_bench(unsigned long count)
+{
+	host_verbose = false;
+	host_bench_running = true;
+	host_bench_left = count;
+	host_bench_events = host_events;
+	host_bench_sim = host_jiffies;
+	clock_gettime(CLOCK_MONOTONIC, &host_bench_start);
+	host_bench_next();
+}
+
+/* Time-to-switch marks */
+static struct {
+	char label[32];
+	unsigned long long start;
+	double ms;
+} host_marks[32];
+static unsigned char host_nmarks;
+
+static void host_mark(const char *label)
+{
+	if (host_nmarks == sizeof(host_marks) / sizeof(*host_marks))
+		return;
+
+	snprintf(host_marks[host_nmarks].label,
+			sizeof(host_marks[host_nmarks].label), "%s", label);
+	host_marks[host_nmarks].start = host_jiffies;
+	host_marks[host_nmarks].ms = -1;
+	host_nmarks++;
+}
+
+void host_switch_event(const char *fmt, ...)
+{
+	char str[64];
+	va_list ap;
+	double ms;
+
+	va_start(ap, fmt);
+	vsnprintf(str, sizeof(str), fmt, ap);
+	va_end(ap);
+
+	if (!host_nmarks) {
+		host_log("host", "switch: %s", str);
+		return;
+	}
+
+	ms = HOST_JIFFIES_TO_MS(host_jiffies - host_marks[host_nmarks - 1].start);
+	if (host_marks[host_nmarks - 1].ms < 0)
+		host_marks[host_nmarks - 1].ms = ms;
+	host_log("host", "switch: %s, %.1f ms after %s", str, ms,
+					host_marks[host_nmarks - 1].label);
+}
+
+static void host_exit(void)
+{
+	unsigned char i;
+
+	printf("max depth: serial rx %u, ir %u, cec rx %u, serial tx %u, "
+		"cec tx %u\n", cec_tv_depth[0], cec_tv_depth[1],
+		cec_tv_depth[2], cec_tv_depth[3], cec_tv_depth[4]);
+#ifdef DIAG_COUNTERS
+	printf("serial commands dropped: %u, cec frames held: %u, "
+		"ir edges dropped: %u, ir frames bad: %u\n",
+		diag_counters.lg_timeout, diag_counters.cec_rx_held,
+		diag_counters.ir_edge_drop, diag_counters.ir_error);
+#endif
+	printf("eeprom waits: %u\n", host_eeprom_waits);
+
+	for (i = 0; i < host_nmarks; i++) {
+		if (host_marks[i].ms < 0)
+			printf("%s: no switch\n", host_marks[i].label);
+		else
+			printf("%s: %.1f ms to switch\n", host_marks[i].label,
+							host_marks[i].ms);
+	}
+
+	if (host_eeprom_file) {
+		FILE *f = fopen(host_eeprom_file, "wb");
+		if (f) {
+			fwrite(host_eeprom, sizeof(host_eeprom), 1, f);
+			fclose(f);
+		}
+	}
+	exit(0);
+}
+
+static unsigned short host_phys(const char *str, char **end)
+{
+	unsigned short phys = 0;
+	unsigned char i;
+
+	for (i = 0; i < 4; i++) {
+		phys = phys << 4 | (strtoul(str, end, 16) & 0xf);
+		str = *end;
+		if (*str == '.')
+			str++;
+	}
+	*end = (char *) str;
+	return phys;
+}
+
+static unsigned char host_device_type(const char *str)
+{
+	static const char *types[] = {
+		"tv", "record", "", "tuner", "playback", "audio", "switch",
+	};
+	unsigned char i;
+
+	for (i = 0; i < sizeof(types) / sizeof(*types); i++)
+		if (!strcmp(str, types[i]))
+			return i;
+	return strtoul(str, NULL, 0);
+}
+
+/* Read script lines until one of them lets time pass */
+static void host_script_next(void)
+{
+	char line[256];
+	char *cmd, *args;
+
+	while (fgets(line, sizeof(line), host_script)) {
+		line[strcspn(line, "\r\n#")] = '\0';
+		cmd = strtok(line, " \t");
+		if (!cmd)
+			continue;
+		args = strtok(NULL, "");
+		if (!args)
+			args = "";
+
+		if (!strcmp(cmd, "run")) {
+			host_run_until = host_jiffies +
+				HOST_MS_TO_JIFFIES(strtod(args, NULL));
+			return;
+		} else if (!strcmp(cmd, "ir")) {
+			unsigned long code, hold;
+			char *end;
+
+			code = strtoul(args, &end, 16);
+			hold = strtoul(end, NULL, 0);
+			host_ir_press(IR_NEC, 4, code, hold);
+		} else if (!strcmp(cmd, "remote")) {
+			static const char *names[] = {
+				[IR_NEC] = "nec", [IR_NECX] = "necx",
+				[IR_SIRC] = "sirc", [IR_RC5] = "rc5",
+				[IR_RC6] = "rc6",
+			};
+			unsigned long address, code, hold;
+			unsigned char protocol;
+			char *name, *end;
+
+			name = strtok(args, " \t");
+			for (protocol = 0; protocol < 5; protocol++)
+				if (name && !strcmp(name, names[protocol]))
+					break;
+			end = strtok(NULL, "");
+			address = strtoul(end ? end : "", &end, 16);
+			code = strtoul(end, &end, 16);
+			hold = strtoul(end, NULL, 0);
+			if (protocol < 5)
+				host_ir_press(protocol, address, code, hold);
+		} else if (!strcmp(cmd, "serial"))
+			host_uart_send(args, strlen(args));
+		else if (!strcmp(cmd, "tv"))
+			lg_tv_power(!strcmp(args, "on"));
+		else if (!strcmp(cmd, "cec")) {
+			unsigned char buf[16];
+			unsigned char len = 0;
+			char *tok;
+
+			for (tok = strtok(args, " \t:"); tok && len < sizeof(buf);
+						tok = strtok(NULL, " \t:"))
+				buf[len++] = strtoul(tok, NULL, 16);
+			host_cec_inject(buf, len);
+		} else if (!strcmp(cmd, "device")) {
+			unsigned char addr;
+			unsigned short phys;
+			char *end, *type;
+
+			addr = strtoul(args, &end, 16);
+			phys = host_phys(end, &end);
+			type = strtok(end, " \t");
+			end = strtok(NULL, "");
+			host_cec_device(addr, phys, host_device_type(type ? : ""),
+					end ? strtoul(end, NULL, 0) : 100);
+		} else if (!strcmp(cmd, "plug") || !strcmp(cmd, "unplug"))
+			host_cec_plug(strtoul(args, NULL, 16), cmd[0] == 'p');
+		else if (!strcmp(cmd, "play"))
+			host_cec_play(strtoul(args, NULL, 16));
+		else if (!strcmp(cmd, "standby"))
+			host_cec_standby(strtoul(args, NULL, 16));
+		else if (!strcmp(cmd, "routing")) {
+			unsigned short from, to;
+			unsigned char addr;
+			char *end;
+
+			addr = strtoul(args, &end, 16);
+			from = host_phys(end, &end);
+			to = host_phys(end, &end);
+			host_cec_routing(addr, from, to);
+		} else if (!strcmp(cmd, "routinginfo")) {
+			unsigned char addr;
+			char *end;
+
+			addr = strtoul(args, &end, 16);
+			host_cec_routing_info(addr, host_phys(end, &end));
+		} else if (!strcmp(cmd, "mark"))
+			host_mark(args);
+		else if (!strcmp(cmd, "bench")) {
+			host_bench(strtoul(args, NULL, 0));
+			return;
+		} else {
+			fprintf(stderr, "Unknown command: %s\n", cmd);
+			exit(1);
+		}
+	}
+
+	host_exit();
+}
+
+#ifdef DIAG_TRACE
+/* Log the keys the IR decoder queued, as they land in the diag trace */
+static void host_ir_trace(void)
+{
+	static unsigned char next;
+
+	if (!diag_trace.used)
+		next = 0;
+
+	for (; next != diag_trace.next; next = (next + 1) % DIAG_TRACE_LEN) {
+		if (diag_trace.rec[next].event == DIAG_EV_IR_PRESS)
+			host_log("ir", "press %02x", diag_trace.rec[next].arg);
+		else if (diag_trace.rec[next].event == DIAG_EV_IR_RELEASE)
+			host_log("ir", "release %02x",
+						diag_trace.rec[next].arg);
+	}
+}
+#endif
+
+void host_tick(void)
+{
+#ifdef DIAG_TRACE
+	host_ir_trace();
+#endif
+	ir_nec_isr_advance();
+	usi_uart_isr_advance();
+	host_cec_advance();
+	lg_tv_advance();
+
+	if (host_jiffies < host_run_until)
+		return;
+
+	if (host_bench_running)
+		host_bench_next();
+	else
+		host_script_next();
+}
+
+int main(int argc, char **argv)
+{
+	host_script = stdin;
+	if (argc > 1) {
+		host_script = fopen(argv[1], "r");
+		if (!host_script) {
+			perror(argv[1]);
+			return 1;
+		}
+	}
+
+	memset(host_eeprom, 0xff, sizeof(host_eeprom));
+	if (keymap_pack(host_eeprom + KEYMAP_ADDR,
+				KEYMAP_END - KEYMAP_ADDR) < 0)
+		return 1;
+
+	if (argc > 2) {
+		FILE *f;
+
+		host_eeprom_file = argv[2];
+		f = fopen(host_eeprom_file, "rb");
+		if (f) {
+			if (fread(host_eeprom, sizeof(host_eeprom), 1, f) != 1)
+				fprintf(stderr, "%s: short read\n", argv[2]);
+			fclose(f);
+		}
+	}
+
+	return firmware_main();
+}
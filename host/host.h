@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host harness interfaces. The firmware (main.c and everything it includes)
+ * is built for Linux against the shims in this directory and linked with C
+ * models of the pieces that are assembly or hardware on the ATtiny45:
+ *
+ * usi_uart_isr.c - USI UART interrupt and jiffies timebase
+ * ir_nec_isr.c - INT0 edge FIFO and an IR remote edge generator
+ * lg_tv.c - The TV end of the LG RS-232 port
+ * avr-cec/cec.c - avr-cec driver stand-in, just the driver buffers
+ * cec_bus.c - The CEC bus and simulated devices on it
+ *
+ * Simulated time advances each time the firmware main loop reads jiffies32().
+ */
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stdbool.h>
+
+/* Simulated time, never wraps */
+extern unsigned long long host_jiffies;
+
+/* Print harness output */
+extern bool host_verbose;
+
+/* Jiffies per main loop pass, one USI overflow */
+#define HOST_LOOP_JIFFIES	(HZ_TO_JIFFIES_RND(9600UL * 4) * 8)
+
+#define HOST_MS_TO_JIFFIES(ms)	((unsigned long long) ((ms) * JIFFIES_HZ / 1000.0))
+#define HOST_JIFFIES_TO_MS(j)	((j) * 1000.0 / JIFFIES_HZ)
+
+void host_log(const char *who, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/* Run all models up to the current host_jiffies */
+void host_tick(void);
+
+/* usi_uart_isr.c */
+void usi_uart_isr_advance(void);
+void host_uart_send(const char *str, unsigned char len);
+
+/* ir_nec_isr.c */
+extern volatile unsigned char ir_nec_edge_overrun;
+void ir_nec_isr_advance(void);
+void host_ir_press(unsigned char protocol, unsigned short address,
+				unsigned char code, unsigned int hold_ms);
+
+/* lg_tv.c */
+void lg_tv_advance(void);
+void lg_tv_rx(unsigned char c);
+void lg_tv_power(bool on);
+
+/* cec_bus.c */
+void host_cec_advance(void);
+bool host_cec_inject(const unsigned char *buf, unsigned char len);
+void host_cec_device(unsigned char addr, unsigned short phys,
+				unsigned char type, unsigned int reply_ms);
+void host_cec_plug(unsigned char addr, bool present);
+void host_cec_play(unsigned char addr);
+void host_cec_standby(unsigned char addr);
+void host_cec_routing(unsigned char addr, unsigned short from,
+							unsigned short to);
+void host_cec_routing_info(unsigned char addr, unsigned short phys);
+
+/* The firmware switched inputs, reported against the last mark */
+void host_switch_event(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+/* cec_tv.c, deepest backlog per event source */
+extern unsigned char cec_tv_depth[5];
+
+/* Event counters for benchmarking */
+extern unsigned long host_events;
+
+#endif
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host model of ir_nec_isr.S, which only queues timestamped edges for the
+ * decoder in ir_nec.c, plus IR remotes that generate edges on PB2.
+ */
+
+#include <avr/io.h>
+#include <stdbool.h>
+
+#include "time.h"
+#include "host.h"
+
+/* The functions are static in main.c's unit, we just want the FIFO */
+#undef IR_NEC_PUBLIC
+#define IR_NEC_PUBLIC
+#include "ir_nec.h"
+
+volatile unsigned char ir_nec_edges[IR_NEC_FIFO * IR_NEC_EDGE];
+volatile unsigned char ir_nec_edge_head;
+volatile unsigned char ir_nec_edge_tail;
+volatile unsigned char ir_nec_edge_overrun;
+
+/*
+ * __vector_1, j is the jiffies value at the time of the edge. It goes in
+ * as _jiffies with TCNT0 at 0 and the USI counter at 8, which
+ * ir_nec_periodic() adds back up to j.
+ */
+static void ir_nec_isr(unsigned short j)
+{
+	unsigned char head = ir_nec_edge_head;
+
+	if (((ir_nec_edge_tail - head) & IR_NEC_EDGE_MASK) == IR_NEC_EDGE) {
+		if (ir_nec_edge_overrun != 0xff)
+			ir_nec_edge_overrun++;
+		return;
+	}
+
+	ir_nec_edges[head] = 0;
+	ir_nec_edges[head + 1] = 8 | (PINB & _BV(PB2) ? 0x80 : 0);
+	ir_nec_edges[head + 2] = j;
+	ir_nec_edges[head + 3] = j >> 8;
+	ir_nec_edge_head = (head + IR_NEC_EDGE) & IR_NEC_EDGE_MASK;
+}
+
+/* Pending edges, level is the new state of the (active low) IR output */
+struct ir_edge {
+	unsigned long long when;
+	bool level;
+	/* Last edge of a full code, counted as an event */
+	bool code_end;
+};
+
+static struct ir_edge ir_edges[1024];
+static unsigned int ir_edge_head;
+static unsigned int ir_edge_tail;
+
+static unsigned long long ir_edge_add(unsigned long long when, double us,
+								bool level)
+{
+	struct ir_edge *edge;
+
+	edge = ir_edges + (ir_edge_head++ % (sizeof(ir_edges) / sizeof(*ir_edges)));
+	edge->when = when;
+	edge->level = level;
+	edge->code_end = false;
+
+	return when + HOST_MS_TO_JIFFIES(us / 1000);
+}
+
+static unsigned long long ir_mark_space(unsigned long long when,
+						double mark_us, double space_us)
+{
+	when = ir_edge_add(when, mark_us, false);
+	return ir_edge_add(when, space_us, true);
+}
+
+/*
+ * Bi-phase bits go out as runs, merged here until the level changes. Each
+ * edge is queued once the run it starts is over.
+ */
+static double ir_run_us;
+static bool ir_run_mark;
+static bool ir_run_started;
+
+static unsigned long long ir_run_flush(unsigned long long when)
+{
+	/* Spaces before the first mark are just idle */
+	if (ir_run_mark || ir_run_started)
+		when = ir_edge_add(when, ir_run_us, !ir_run_mark);
+	else
+		when += HOST_MS_TO_JIFFIES(ir_run_us / 1000);
+	ir_run_started |= ir_run_mark;
+	ir_run_us = 0;
+
+	return when;
+}
+
+static unsigned long long ir_run(unsigned long long when, bool mark,
+								double us)
+{
+	if (ir_run_us && mark != ir_run_mark)
+		when = ir_run_flush(when);
+	ir_run_mark = mark;
+	ir_run_us += us;
+
+	return when;
+}
+
+/* Finish the frame, the line stays idle after a trailing space */
+static unsigned long long ir_run_end(unsigned long long when)
+{
+	bool mark = ir_run_mark;
+
+	when = ir_run_flush(when);
+	if (mark)
+		when = ir_edge_add(when, 0, true);
+	ir_run_started = false;
+
+	return when;
+}
+
+static unsigned long long ir_biphase(unsigned long long when, bool one_mark,
+					unsigned long data, unsigned char bits,
+					double us)
+{
+	bool mark;
+
+	while (bits--) {
+		mark = !(data >> bits & 1) != one_mark;
+		when = ir_run(when, mark, us);
+		when = ir_run(when, !mark, us);
+	}
+
+	return when;
+}
+
+/* One frame starting at when, returns the time of its last edge */
+static unsigned long long ir_frame(unsigned long long when,
+				unsigned char protocol, unsigned short address,
+				unsigned char code, bool toggle)
+{
+	unsigned long data;
+	unsigned char i, bits;
+
+	switch (protocol) {
+	case IR_NEC:
+	case IR_NECX:
+		if (protocol == IR_NEC)
+			address = address | (~address & 0xff) << 8;
+		data = address;
+		data |= (unsigned long) code << 16;
+		data |= (unsigned long) (~code & 0xff) << 24;
+
+		when = ir_mark_space(when, 9000, 4500);
+		for (i = 0; i < 32; i++, data >>= 1)
+			when = ir_mark_space(when, 562.5,
+						data & 1 ? 1687.5 : 562.5);
+		return ir_mark_space(when, 562.5, 0);
+
+	case IR_SIRC:
+		bits = address < 0x20 ? 12 : address < 0x100 ? 15 : 20;
+		data = (code & 0x7f) | (unsigned long) address << 7;
+
+		when = ir_mark_space(when, 2400, 600);
+		for (i = 1; i < bits; i++, data >>= 1)
+			when = ir_mark_space(when, data & 1 ? 1200 : 600, 600);
+		return ir_mark_space(when, data & 1 ? 1200 : 600, 0);
+
+	case IR_RC5:
+		data = 0x2000 | (code & 0x40 ? 0 : 0x1000) | toggle << 11 |
+					(address & 0x1f) << 6 | (code & 0x3f);
+		when = ir_biphase(when, false, data, 14, 889);
+		return ir_run_end(when);
+
+	default:
+		/* RC6 mode 0 */
+		when = ir_run(when, true, 2666);
+		when = ir_run(when, false, 889);
+		when = ir_biphase(when, true, 0x8, 4, 444.4);
+		when = ir_biphase(when, true, toggle, 1, 888.9);
+		data = (unsigned long) (address & 0xff) << 8 | code;
+		when = ir_biphase(when, true, data, 16, 444.4);
+		return ir_run_end(when);
+	}
+}
+
+/* Queue up a keypress with repeats until hold_ms has passed */
+void host_ir_press(unsigned char protocol, unsigned short address,
+				unsigned char code, unsigned int hold_ms)
+{
+	static const unsigned int period_ms[] = {
+		[IR_NEC] = 108, [IR_NECX] = 108, [IR_SIRC] = 45,
+		[IR_RC5] = 114, [IR_RC6] = 108,
+	};
+	static const char *names[] = {
+		[IR_NEC] = "nec", [IR_NECX] = "necx", [IR_SIRC] = "sirc",
+		[IR_RC5] = "rc5", [IR_RC6] = "rc6",
+	};
+	static bool toggle;
+	unsigned long long when, start;
+	unsigned int i;
+
+	start = host_jiffies;
+	if (ir_edge_head != ir_edge_tail)
+		start = ir_edges[(ir_edge_head - 1) %
+			(sizeof(ir_edges) / sizeof(*ir_edges))].when +
+			HOST_MS_TO_JIFFIES(40);
+
+	host_log("ir", "> %s %02x %02x", names[protocol], address, code);
+
+	toggle = !toggle;
+	ir_frame(start, protocol, address, code, toggle);
+	ir_edges[(ir_edge_head - 1) %
+			(sizeof(ir_edges) / sizeof(*ir_edges))].code_end = true;
+
+	/* Sony remotes always send at least three frames */
+	for (i = 1; i * period_ms[protocol] < hold_ms ||
+				(protocol == IR_SIRC && i < 3); i++) {
+		when = start + HOST_MS_TO_JIFFIES(i * period_ms[protocol]);
+		if (protocol == IR_NEC || protocol == IR_NECX) {
+			when = ir_mark_space(when, 9000, 2250);
+			ir_mark_space(when, 562.5, 0);
+		} else
+			ir_frame(when, protocol, address, code, toggle);
+	}
+}
+
+void ir_nec_isr_advance(void)
+{
+	struct ir_edge *edge;
+
+	while (ir_edge_tail != ir_edge_head) {
+		edge = ir_edges + (ir_edge_tail %
+				(sizeof(ir_edges) / sizeof(*ir_edges)));
+		if (edge->when > host_jiffies)
+			break;
+		ir_edge_tail++;
+
+		if (edge->level)
+			PINB |= _BV(PB2);
+		else
+			PINB &= ~_BV(PB2);
+
+		if (GIMSK & _BV(INT0))
+			ir_nec_isr(edge->when);
+		if (edge->code_end)
+			host_events++;
+	}
+}
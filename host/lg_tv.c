@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host model of the TV end of the LG RS-232 management port.
+ *
+ * Commands look like "ka 01 01\r" and are answered after LG_TV_REPLY_MS
+ * with "a 01 OK01x" or "a 01 NGx", in the order they arrived. Powering up
+ * takes LG_TV_BOOT_MS, during which everything but power commands is
+ * answered with NG. For LG_TV_SETTLE_MS after that input selects are
+ * dropped without a reply.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "time.h"
+#include "host.h"
+
+#define LG_TV_REPLY_MS		20
+#define LG_TV_BOOT_MS		3000
+#define LG_TV_SETTLE_MS		1500
+
+enum lg_tv_state {
+	LG_TV_OFF,
+	LG_TV_BOOTING,
+	LG_TV_ON,
+};
+
+static unsigned char lg_tv_state;
+static unsigned long long lg_tv_boot_done;
+static unsigned long long lg_tv_settle_done;
+static unsigned char lg_tv_input = 0x90;
+static unsigned char lg_tv_volume = 10;
+static unsigned char lg_tv_mute = 1;
+
+static char lg_tv_cmd[32];
+static unsigned char lg_tv_pos;
+
+#define LG_TV_REPLIES		8
+
+static struct {
+	char buf[16];
+	unsigned char len;
+	unsigned long long at;
+} lg_tv_replies[LG_TV_REPLIES];
+static unsigned char lg_tv_reply_head;
+static unsigned char lg_tv_reply_tail;
+
+void lg_tv_power(bool on)
+{
+	lg_tv_state = on ? LG_TV_ON : LG_TV_OFF;
+	host_log("tv", "power %s", on ? "on" : "off");
+}
+
+static void lg_tv_command(void)
+{
+	unsigned int set_id, data;
+	char cmd1, cmd2;
+	bool ok;
+	char *reply;
+	unsigned char *len;
+
+	host_log("tv", "< %s", lg_tv_cmd);
+
+	if ((unsigned char) (lg_tv_reply_head - lg_tv_reply_tail) == LG_TV_REPLIES) {
+		host_log("tv", "too many commands outstanding");
+		return;
+	}
+	reply = lg_tv_replies[lg_tv_reply_head % LG_TV_REPLIES].buf;
+	len = &lg_tv_replies[lg_tv_reply_head % LG_TV_REPLIES].len;
+
+	if (sscanf(lg_tv_cmd, "%c%c %x %x", &cmd1, &cmd2, &set_id, &data) != 4)
+		return;
+
+	ok = lg_tv_state == LG_TV_ON;
+
+	switch (cmd1 << 8 | cmd2) {
+	case 'k' << 8 | 'a':
+		/* Power */
+		ok = true;
+		if (data == 0) {
+			lg_tv_power(false);
+		} else if (data == 1) {
+			if (lg_tv_state == LG_TV_OFF) {
+				lg_tv_state = LG_TV_BOOTING;
+				lg_tv_boot_done = host_jiffies +
+					HOST_MS_TO_JIFFIES(LG_TV_BOOT_MS);
+				host_log("tv", "booting");
+			}
+		} else
+			data = lg_tv_state == LG_TV_ON;
+		break;
+
+	case 'k' << 8 | 'e':
+		/* Volume mute */
+		if (data == 0xff)
+			data = lg_tv_mute;
+		else if (ok)
+			lg_tv_mute = data;
+		break;
+
+	case 'k' << 8 | 'f':
+		/* Volume */
+		if (data == 0xff)
+			data = lg_tv_volume;
+		else if (ok)
+			lg_tv_volume = data;
+		break;
+
+	case 'k' << 8 | 'm':
+		/* Remote lock, used as a power query */
+		if (data == 0xff)
+			data = 0;
+		break;
+
+	case 'm' << 8 | 'c':
+		/* Remote key */
+		if (ok) {
+			if (data == 0x02 && lg_tv_volume < 100)
+				lg_tv_volume++;
+			else if (data == 0x03 && lg_tv_volume)
+				lg_tv_volume--;
+			else if (data == 0x09)
+				lg_tv_mute = !lg_tv_mute;
+		}
+		break;
+
+	case 'x' << 8 | 'b':
+		/* Input select */
+		if (host_jiffies < lg_tv_settle_done) {
+			host_log("tv", "dropped");
+			return;
+		}
+		if (data == 0xff)
+			data = lg_tv_input;
+		else if (ok) {
+			lg_tv_input = data;
+			host_log("tv", "input %02x", data);
+			host_switch_event("input %02x", data);
+		}
+		break;
+
+	default:
+		ok = false;
+	}
+
+	if (ok)
+		*len = snprintf(reply, sizeof(lg_tv_replies[0].buf),
+				"%c %02x OK%02xx", cmd2, set_id, data);
+	else
+		*len = snprintf(reply, sizeof(lg_tv_replies[0].buf),
+				"%c %02x NGx", cmd2, set_id);
+	lg_tv_replies[lg_tv_reply_head++ % LG_TV_REPLIES].at =
+			host_jiffies + HOST_MS_TO_JIFFIES(LG_TV_REPLY_MS);
+}
+
+void lg_tv_rx(unsigned char c)
+{
+	if (c == '\r') {
+		lg_tv_cmd[lg_tv_pos] = '\0';
+		lg_tv_pos = 0;
+		lg_tv_command();
+	} else if (lg_tv_pos < sizeof(lg_tv_cmd) - 1)
+		lg_tv_cmd[lg_tv_pos++] = c;
+}
+
+void lg_tv_advance(void)
+{
+	if (lg_tv_state == LG_TV_BOOTING && host_jiffies >= lg_tv_boot_done) {
+		lg_tv_power(true);
+		lg_tv_settle_done = host_jiffies +
+					HOST_MS_TO_JIFFIES(LG_TV_SETTLE_MS);
+	}
+
+	while (lg_tv_reply_head != lg_tv_reply_tail &&
+		host_jiffies >= lg_tv_replies[lg_tv_reply_tail % LG_TV_REPLIES].at) {
+		unsigned char i = lg_tv_reply_tail++ % LG_TV_REPLIES;
+
+		host_log("tv", "> %.*s", lg_tv_replies[i].len,
+							lg_tv_replies[i].buf);
+		host_uart_send(lg_tv_replies[i].buf, lg_tv_replies[i].len);
+	}
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host model of usi_uart_isr.S. Works a byte at a time rather than a USI
+ * sample at a time, a byte occupies the wire for 10 bit times in each
+ * direction. Received bytes go into the same ring as on the AVR.
+ */
+
+#include <avr/io.h>
+#include <stdbool.h>
+
+#include "time.h"
+#include "host.h"
+
+/* The functions are static in main.c's unit, we just want the ring */
+#undef USI_UART_PUBLIC
+#define USI_UART_PUBLIC
+#include "usi_uart.h"
+
+#define BAUD		9600UL
+#define BYTE_JIFFIES	(HZ_TO_JIFFIES_RND(BAUD) * 10)
+
+bool ser_overflow;
+volatile unsigned char ser_rx_buf[USI_UART_RX_SIZE];
+volatile unsigned char ser_rx_head;
+volatile unsigned char ser_rx_tail;
+volatile unsigned char ser_rx_overrun;
+
+volatile unsigned char send_consumer;
+static unsigned long long send_done;
+
+/* Bytes on their way from the TV */
+static unsigned char wire_buf[256];
+static unsigned char wire_head;
+static unsigned char wire_tail;
+static unsigned long long wire_done;
+
+/* The firmware main loop calls jiffies32() once per pass */
+unsigned long jiffies32(void)
+{
+	host_jiffies += HOST_LOOP_JIFFIES;
+	host_tick();
+	return host_jiffies;
+}
+
+/* The other views only read the time */
+__uint24 jiffies(void)
+{
+	return host_jiffies & 0xffffff;
+}
+
+unsigned int jiffies16(void)
+{
+	return host_jiffies;
+}
+
+unsigned int ljiffies(void)
+{
+	return host_jiffies >> LJIFFIES_SHIFT;
+}
+
+void host_uart_send(const char *str, unsigned char len)
+{
+	while (len--)
+		wire_buf[wire_head++] = *str++;
+}
+
+void usi_uart_isr_advance(void)
+{
+	/* Receive side */
+	if (wire_head != wire_tail) {
+		if (!wire_done)
+			wire_done = host_jiffies + BYTE_JIFFIES;
+		else if (host_jiffies >= wire_done) {
+			unsigned char next;
+
+			next = (ser_rx_head + 1) & (USI_UART_RX_SIZE - 1);
+			if (next == ser_rx_tail) {
+				if (ser_rx_overrun != 0xff)
+					ser_rx_overrun++;
+				host_log("ser", "overrun");
+			} else {
+				ser_rx_buf[ser_rx_head] = wire_buf[wire_tail];
+				ser_rx_head = next;
+			}
+			wire_tail++;
+			wire_done = 0;
+			host_events++;
+		}
+	}
+
+	/* Transmit side */
+	if (send_done && host_jiffies < send_done)
+		return;
+	send_done = 0;
+
+	if (send_prod == send_consumer)
+		return;
+
+	lg_tv_rx(send_buf[send_consumer]);
+	send_consumer = (send_consumer + 1) & (USI_UART_TX_SIZE - 1);
+	send_done = host_jiffies + BYTE_JIFFIES;
+}
@@ -17,37 +17,508 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
-
-#include <util/atomic.h>
+#include <avr/pgmspace.h>
 
 #include <stdbool.h>
 #include <stdio.h>
 
 #include "time.h"
 #include "ir_nec.h"
+#include "diag.h"
+
+/*
+ * Timings for each protocol. Runs of carrier (marks) and of no carrier
+ * (spaces) are measured in whole units of the protocol, accepting 60% to
+ * 140% of the last unit, and kept as the number of units less one. A pair
+ * is two runs packed as a byte, the earlier one in the high nibble.
+ *
+ * Pulse distance codes (NEC) give a bit for each mark/space pair, pulse
+ * width codes (SIRC) for each space/mark pair. Bi-phase codes (RC5, RC6)
+ * give a bit for each two units, the level of the first half setting it.
+ */
+struct ir_proto {
+	unsigned char protocol;
+	unsigned short unit;
+	unsigned short min;		/* 60% of unit */
+	unsigned short max;		/* 140% of unit */
+	unsigned char start;		/* Leader mark/space pair */
+	unsigned char repeat;		/* Leader pair of a repeat code */
+	unsigned char zero;		/* Pair for a 0 bit */
+	unsigned char one;		/* Pair for a 1 bit */
+	unsigned char wide;		/* Bi-phase bit that is twice as long */
+	unsigned char coding;
+	unsigned char bits;
+	unsigned char bits_min;		/* Shorter frames end when idle */
+	unsigned char period;		/* Repeat period in long jiffies */
+};
+
+#define IR_DISTANCE	0x00
+#define IR_WIDTH	0x01
+#define IR_BIPHASE	0x02
+#define IR_INVERT	0x04		/* Bi-phase 1 starts with a space */
+#define IR_LSB		0x08		/* Sent least significant bit first */
+#define IR_NO_LEADER	0x10		/* Starts with half or all of a bit */
+
+/* NEC is always decoded, the others only if asked for */
+#if defined(IR_NEC_RC5) || defined(IR_NEC_RC6)
+#define IR_NEC_BIPHASE
+#endif
+
+#define IR_UNIT(ns)	NS_TO_JIFFIES_RND(ns), \
+			NS_TO_JIFFIES_RND((ns) * 6 / 10), \
+			NS_TO_JIFFIES_RND((ns) * 14 / 10)
+
+static const struct ir_proto ir_protos[] PROGMEM = {
+	/* 9.00ms/4.50ms leader, 9.00ms/2.25ms repeat, 32 bits */
+	{
+		IR_NEC, IR_UNIT(565500), 0xf7, 0xf3, 0x00, 0x02, 0xff,
+		IR_DISTANCE | IR_LSB, 32, 32, MS_TO_LJIFFIES_UP(108),
+	},
+#ifdef IR_NEC_SIRC
+	/* 2.4ms/0.6ms leader, 0.6ms spaces, 12, 15 or 20 bits */
+	{
+		IR_SIRC, IR_UNIT(600000), 0x30, 0x00, 0x00, 0x01, 0xff,
+		IR_WIDTH | IR_LSB, 20, 12, MS_TO_LJIFFIES_UP(45),
+	},
+#endif
+#ifdef IR_NEC_RC5
+	/* 889us half bits, two start bits, toggle, 5 bit address, command */
+	{
+		IR_RC5, IR_UNIT(889000), 0x00, 0x00, 0x00, 0x00, 0xff,
+		IR_BIPHASE | IR_INVERT | IR_NO_LEADER, 14, 14,
+		MS_TO_LJIFFIES_UP(114),
+	},
+#endif
+#ifdef IR_NEC_RC6
+	/* Mode 0, 2.666ms/0.889ms leader, start, mode, toggle, 16 bits */
+	{
+		IR_RC6, IR_UNIT(444444), 0x51, 0x00, 0x00, 0x00, 4,
+		IR_BIPHASE, 21, 21, MS_TO_LJIFFIES_UP(108),
+	},
+#endif
+};
+
+#define IR_NEC_PROTOS	(sizeof(ir_protos) / sizeof(*ir_protos))
+
+/* Frames with fewer than bits end when the line is quiet this long */
+#define IR_NEC_QUIET	MS_TO_JIFFIES_RND(4)
+
+/* Timer0 ticks per USI counter step, TCNT_TOT in usi_uart_isr.S */
+#define IR_NEC_TCNT_TOT	HZ_TO_JIFFIES_RND(9600 * 4)
+
+enum {
+	IR_NEC_IDLE,
+	IR_NEC_LEADER,
+	IR_NEC_DATA,
+};
+
+/* The key that is held, and how long to wait for its next repeat */
+static struct ir_event ir_nec_last;
+static bool ir_nec_has_last;
+static unsigned char ir_nec_toggle;
+static unsigned char ir_nec_hold;
+
+/* Long jiffies, for event times */
+static unsigned char ir_nec_now;
+
+static struct ir_event ir_nec_queue[IR_NEC_EVENTS];
+static unsigned char ir_nec_queue_head;
+unsigned char ir_nec_events;
+
+static unsigned char ir_nec_last_pins;
+static unsigned short ir_nec_last_time;
+static unsigned char ir_nec_state;
+static const struct ir_proto *ir_nec_proto;
+static unsigned char ir_nec_pair;
+static unsigned char ir_nec_bits;
+#ifdef IR_NEC_BIPHASE
+static unsigned char ir_nec_half;
+#endif
+static unsigned long ir_nec_value;
+
+/* Units in delta less one, 0xff if it is not close to a whole number */
+static unsigned char ir_nec_period(const struct ir_proto *p,
+							unsigned short delta)
+{
+	unsigned short unit = pgm_read_word(&p->unit);
+	unsigned short max = pgm_read_word(&p->max);
+	unsigned char period = 0;
+
+	while (delta >= max) {
+		delta -= unit;
+		if (++period == 16)
+			return 0xff;
+	}
+
+	return delta < pgm_read_word(&p->min) ? 0xff : period;
+}
+
+/* Queue an event for the held key, dropped if the queue is full */
+static void ir_nec_queue_add(unsigned char type)
+{
+	struct ir_event *ev;
+
+	if (type != IR_REPEAT)
+		DIAG_EVENT(type == IR_PRESS ? DIAG_EV_IR_PRESS :
+				DIAG_EV_IR_RELEASE, ir_nec_last.command);
+
+	if (ir_nec_events == IR_NEC_EVENTS) {
+		DIAG_COUNT(ir_event_drop);
+		return;
+	}
+
+	ev = ir_nec_queue + ((ir_nec_queue_head + ir_nec_events++) &
+							(IR_NEC_EVENTS - 1));
+	*ev = ir_nec_last;
+	ev->type = type;
+	ev->time = ir_nec_now;
+}
+
+IR_NEC_PUBLIC bool ir_nec_get(struct ir_event *ev)
+{
+	if (!ir_nec_events)
+		return false;
+
+	*ev = ir_nec_queue[ir_nec_queue_head];
+	ir_nec_queue_head = (ir_nec_queue_head + 1) & (IR_NEC_EVENTS - 1);
+	ir_nec_events--;
+
+	return true;
+}
+
+/* Report a frame, a repeat if it matches the key that is held */
+static void ir_nec_emit(unsigned char protocol, unsigned short address,
+					unsigned char command, unsigned char toggle)
+{
+	unsigned char period = pgm_read_byte(&ir_nec_proto->period);
+	unsigned char seen;
+
+	if (ir_nec_has_last && protocol == ir_nec_last.protocol &&
+			address == ir_nec_last.address &&
+			command == ir_nec_last.command &&
+			toggle == ir_nec_toggle) {
+		/*
+		 * Wait a quarter period past the repeat period we see, plus
+		 * a tick for rounding, rather than the worst case. The first
+		 * NEC repeat code comes early, so only go by later ones.
+		 */
+		seen = ir_nec_now - ir_nec_last.time;
+		if (ir_nec_last.type == IR_REPEAT && seen < period * 2)
+			period = seen;
+		ir_nec_last.type = IR_REPEAT;
+		ir_nec_last.time = ir_nec_now;
+		ir_nec_hold = period + period / 4 + 1;
+		DIAG_COUNT(ir_repeat);
+		ir_nec_queue_add(IR_REPEAT);
+		return;
+	}
+
+	if (ir_nec_has_last)
+		ir_nec_queue_add(IR_RELEASE);
+
+	ir_nec_has_last = true;
+	ir_nec_toggle = toggle;
+	ir_nec_last.type = IR_PRESS;
+	ir_nec_last.protocol = protocol;
+	ir_nec_last.address = address;
+	ir_nec_last.command = command;
+	ir_nec_last.time = ir_nec_now;
+	/* The first repeat may take up to a full period after the frame */
+	ir_nec_hold = period + period / 4 + 1;
+	ir_nec_queue_add(IR_PRESS);
+}
+
+/* Check a complete frame and pull out its fields */
+static void ir_nec_finish(void)
+{
+	unsigned char protocol = pgm_read_byte(&ir_nec_proto->protocol);
+	unsigned long v = ir_nec_value;
+	unsigned short address;
+	unsigned char command;
+	unsigned char toggle = 0;
+
+	ir_nec_state = IR_NEC_IDLE;
+
+	if (pgm_read_byte(&ir_nec_proto->coding) & IR_LSB)
+		v >>= 32 - ir_nec_bits;
+
+	switch (protocol) {
+	case IR_NEC:
+		/* The command is followed by its inverse */
+		command = v >> 16;
+		if ((unsigned char) ~(v >> 24) != command)
+			goto error;
+		/* As is the address, unless it is a 16 bit one */
+		address = v;
+		if ((unsigned char) ~(address >> 8) == (address & 0xff))
+			address &= 0xff;
+		else
+			protocol = IR_NECX;
+		/* Held keys send repeat codes, a full frame is a new press */
+		toggle = ~ir_nec_toggle;
+		break;
+
+#ifdef IR_NEC_SIRC
+	case IR_SIRC:
+		/* 7 bit command, then a 5, 8 or 13 bit address */
+		if (ir_nec_bits != 12 && ir_nec_bits != 15 && ir_nec_bits != 20)
+			goto error;
+		command = v & 0x7f;
+		address = v >> 7;
+		break;
+#endif
+
+#ifdef IR_NEC_RC5
+	case IR_RC5:
+		/* The second start bit is the inverse of command bit 6 */
+		command = (v & 0x3f) | (v & _BV(12) ? 0 : 0x40);
+		address = (v >> 6) & 0x1f;
+		toggle = (v >> 11) & 1;
+		break;
+#endif
+
+#ifdef IR_NEC_RC6
+	case IR_RC6:
+		/* Start bit set and mode 0 */
+		if ((v >> 17) != 0x08)
+			goto error;
+		command = v;
+		address = (v >> 8) & 0xff;
+		toggle = (v >> 16) & 1;
+		break;
+#endif
 
-unsigned char ir_nec_repeat_timer;
-bool ir_nec_has_last;
+	default:
+		goto error;
+	}
+
+	ir_nec_emit(protocol, address, command, toggle);
+	return;
+
+error:
+	DIAG_COUNT(ir_error);
+}
+
+/* Add the next bit of the frame */
+static void ir_nec_shift(bool bit)
+{
+	if (pgm_read_byte(&ir_nec_proto->coding) & IR_LSB) {
+		ir_nec_value >>= 1;
+		if (bit)
+			ir_nec_value |= 0x80000000UL;
+	} else
+		ir_nec_value = ir_nec_value << 1 | bit;
+
+	if (++ir_nec_bits == pgm_read_byte(&ir_nec_proto->bits))
+		ir_nec_finish();
+}
+
+#ifdef IR_NEC_BIPHASE
+/*
+ * A run of units for a bi-phase code. The frame is done as soon as the
+ * first half of its last bit is in, the second half may never end.
+ */
+static bool ir_nec_biphase(unsigned char units, bool mark)
+{
+	const struct ir_proto *p = ir_nec_proto;
+	unsigned char width;
+	bool first = true;
+
+	do {
+		width = ir_nec_half >> 1 == pgm_read_byte(&p->wide) ? 2 : 1;
+		if (units < width)
+			return false;
+		units -= width;
+
+		if (!(ir_nec_half & 1)) {
+			ir_nec_shift(mark ^ !!(pgm_read_byte(&p->coding) &
+								IR_INVERT));
+			if (ir_nec_state == IR_NEC_IDLE)
+				return true;
+		} else if (!first)
+			/* Both halves of a bit at the same level */
+			return false;
+
+		first = false;
+		ir_nec_half++;
+	} while (units);
+
+	return true;
+}
+#endif
+
+/* A mark from idle, find the protocol with a leader that matches */
+static void ir_nec_start(unsigned short delta)
+{
+	const struct ir_proto *p;
+	unsigned char period;
+
+	for (p = ir_protos; p < ir_protos + IR_NEC_PROTOS; p++) {
+		period = ir_nec_period(p, delta);
+
+		if (!(pgm_read_byte(&p->coding) & IR_NO_LEADER)) {
+			if (period != pgm_read_byte(&p->start) >> 4)
+				continue;
+			ir_nec_proto = p;
+			ir_nec_pair = period;
+			ir_nec_state = IR_NEC_LEADER;
+			return;
+		}
+
+#ifdef IR_NEC_RC5
+		/* RC5, the mark is the second half of the first start bit */
+		if (period > 1)
+			continue;
+		ir_nec_proto = p;
+		ir_nec_state = IR_NEC_DATA;
+		ir_nec_value = 1;
+		ir_nec_bits = 1;
+		ir_nec_half = 1;
+		if (!ir_nec_biphase(period + 1, true))
+			ir_nec_state = IR_NEC_IDLE;
+		return;
+#endif
+	}
+}
 
-bool ir_nec_ready;
-unsigned char ir_nec_output[2];
+/* Run the decoder for an edge to pins at time j */
+static void ir_nec_edge(unsigned char pins, unsigned short j)
+{
+	const struct ir_proto *p = ir_nec_proto;
+	unsigned short delta;
+	unsigned char period;
+	unsigned char coding;
+
+	/*
+	 * Our state machine assumes a transition has occurred, but a fast
+	 * toggle can cause an interrupt but we still have the same state.
+	 * Ignore this case.
+	 */
+	if (pins == ir_nec_last_pins)
+		return;
+	ir_nec_last_pins = pins;
+
+	delta = j - ir_nec_last_time;
+	ir_nec_last_time = j;
+
+	/* The output is active low, going high ends a mark */
+	if (ir_nec_state == IR_NEC_IDLE) {
+		if (pins)
+			ir_nec_start(delta);
+		return;
+	}
+
+	period = ir_nec_period(p, delta);
+	if (period == 0xff)
+		goto error;
+	coding = pgm_read_byte(&p->coding);
+
+	if (ir_nec_state == IR_NEC_LEADER) {
+		/* Always the end of the leader's space */
+		ir_nec_pair = ir_nec_pair << 4 | period;
+		if (ir_nec_pair == pgm_read_byte(&p->start)) {
+			ir_nec_state = IR_NEC_DATA;
+			ir_nec_value = 0;
+			ir_nec_bits = 0;
+#ifdef IR_NEC_BIPHASE
+			ir_nec_half = 0;
+#endif
+			return;
+		}
+		if (ir_nec_pair != pgm_read_byte(&p->repeat))
+			goto error;
+
+		/* NEC repeat code, the last key is still held */
+		ir_nec_state = IR_NEC_IDLE;
+		if (ir_nec_has_last && (ir_nec_last.protocol == IR_NEC ||
+					ir_nec_last.protocol == IR_NECX))
+			ir_nec_emit(ir_nec_last.protocol, ir_nec_last.address,
+					ir_nec_last.command, ir_nec_toggle);
+		return;
+	}
+
+#ifdef IR_NEC_BIPHASE
+	if (coding & IR_BIPHASE) {
+		if (!ir_nec_biphase(period + 1, pins))
+			goto error;
+		return;
+	}
+#endif
+
+	/* Distance coded bits end with their space, width coded with a mark */
+	ir_nec_pair = ir_nec_pair << 4 | period;
+	if (!pins != !(coding & IR_WIDTH))
+		return;
 
-extern unsigned char ir_nec_last_pins;
+	if (ir_nec_pair == pgm_read_byte(&p->zero))
+		ir_nec_shift(false);
+	else if (ir_nec_pair == pgm_read_byte(&p->one))
+		ir_nec_shift(true);
+	else
+		goto error;
+	return;
 
-/* Needs to be called every ~562.5uS */
-/* FIXME: Set special do_release flag when starting a new keypress */
+error:
+	/* Drop the frame, the mark may be the leader of the next one */
+	DIAG_COUNT(ir_error);
+	ir_nec_state = IR_NEC_IDLE;
+	if (pins)
+		ir_nec_start(delta);
+}
+
+/* Decode the edges queued by __vector_1 */
+static void ir_nec_edges_periodic(void)
+{
+	unsigned char tail = ir_nec_edge_tail;
+	unsigned char cnt;
+	unsigned short j;
+
+	while (tail != ir_nec_edge_head) {
+		/* The same sum jiffies32() does, from the ISR's snapshot */
+		cnt = ir_nec_edges[tail + 1];
+		j = ir_nec_edges[tail + 2] | ir_nec_edges[tail + 3] << 8;
+		j += ir_nec_edges[tail];
+		j += ((cnt & 0x0f) ^ 8) * IR_NEC_TCNT_TOT;
+
+		ir_nec_edge(cnt & 0x80 ? _BV(PB2) : 0, j);
+
+		tail = (tail + IR_NEC_EDGE) & IR_NEC_EDGE_MASK;
+		ir_nec_edge_tail = tail;
+	}
+}
+
+/* Needs to be called before the edge FIFO fills, about 1.7ms of NEC */
 IR_NEC_PUBLIC void ir_nec_periodic(unsigned char delta_long)
 {
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		ir_nec_repeat_timer += delta_long;
-		if (ir_nec_repeat_timer > (unsigned int) MS_TO_LJIFFIES_UP(108 * 2.5)) {
-			ir_nec_repeat_timer = 0;
-			if (ir_nec_has_last)
-				ir_nec_release();
-			ir_nec_has_last = false;
+	unsigned short quiet;
+
+	ir_nec_edges_periodic();
+
+	/* Frames that can be short end once the line goes quiet */
+	if (ir_nec_state == IR_NEC_DATA) {
+		quiet = jiffies16() - ir_nec_last_time;
+		if (quiet > IR_NEC_QUIET &&
+				ir_nec_edge_head == ir_nec_edge_tail) {
+			if (ir_nec_bits >=
+				    pgm_read_byte(&ir_nec_proto->bits_min))
+				ir_nec_finish();
+			else {
+				/* A lone mark, like the one ending NEC, isn't */
+				if (ir_nec_bits > 1)
+					DIAG_COUNT(ir_error);
+				ir_nec_state = IR_NEC_IDLE;
+			}
 		}
 	}
 
+	/* Let go of the key once a repeat is overdue */
+	ir_nec_now += delta_long;
+	if (ir_nec_has_last &&
+			(unsigned char) (ir_nec_now - ir_nec_last.time) >
+							ir_nec_hold) {
+		ir_nec_queue_add(IR_RELEASE);
+		ir_nec_has_last = false;
+	}
 }
 
 IR_NEC_PUBLIC void ir_nec_init(void)
@@ -18,17 +18,78 @@
 #ifndef _IR_NEC_H_
 #define _IR_NEC_H_
 
+/* Edge FIFO size, a power of 2. Holds one less edge than this. */
+#ifndef IR_NEC_FIFO
+#define IR_NEC_FIFO		4
+#endif
+
+/* Bytes per edge: TCNT0, USI counter | level << 7, _jiffies low, high */
+#define IR_NEC_EDGE		4
+#define IR_NEC_EDGE_MASK	(IR_NEC_FIFO * IR_NEC_EDGE - 1)
+
+#ifndef __ASSEMBLER__
+
+#include <stdbool.h>
+
 #ifndef IR_NEC_PUBLIC
 #define IR_NEC_PUBLIC
 #endif
 
-extern unsigned char ir_nec_output[2];
-extern bool ir_nec_ready;
+/* Protocols the decoder knows, IR_NECX is reported for 16 bit addresses */
+#define IR_NEC			0
+#define IR_SIRC			1
+#define IR_RC5			2
+#define IR_RC6			3
+#define IR_NECX			4
+
+/*
+ * Events queued for the main loop, a power of 2. The main loop takes them
+ * the pass they are queued, or after an EEPROM write of up to 27ms, well
+ * inside the 108ms between NEC frames, so two hold a release and the next
+ * press.
+ */
+#ifndef IR_NEC_EVENTS
+#define IR_NEC_EVENTS		2
+#endif
+
+/*
+ * A key goes down with IR_PRESS, sends IR_REPEAT for NEC repeat codes and
+ * for SIRC, RC5 and RC6 frames that match it (and its toggle bit), and is
+ * let go with IR_RELEASE once the repeats stop or another key is pressed.
+ * time is the long jiffies count when the event was queued.
+ */
+#define IR_PRESS		0
+#define IR_REPEAT		1
+#define IR_RELEASE		2
+
+struct ir_event {
+	unsigned char type;
+	unsigned char protocol;
+	unsigned short address;
+	unsigned char command;
+	unsigned char time;
+};
+
+/* Events waiting for ir_nec_get() */
+extern unsigned char ir_nec_events;
+
+/*
+ * Edge FIFO, filled by __vector_1. Only the ISR writes ir_nec_edge_head and
+ * only the main loop writes ir_nec_edge_tail, both are byte offsets into
+ * ir_nec_edges. Edges that arrive with the FIFO full are counted in
+ * ir_nec_edge_overrun.
+ */
+extern volatile unsigned char ir_nec_edges[IR_NEC_FIFO * IR_NEC_EDGE];
+extern volatile unsigned char ir_nec_edge_head;
+extern volatile unsigned char ir_nec_edge_tail;
+extern volatile unsigned char ir_nec_edge_overrun;
 
 IR_NEC_PUBLIC void ir_nec_init(void);
 IR_NEC_PUBLIC void ir_nec_periodic(unsigned char delta_long);
 
-IR_NEC_PUBLIC void ir_nec_release();
+IR_NEC_PUBLIC bool ir_nec_get(struct ir_event *ev);
+
+#endif
 
 #endif
 
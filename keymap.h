@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _KEYMAP_H_
+#define _KEYMAP_H_
+
+/*
+ * Keymaps are stored in the EEPROM from KEYMAP_ADDR up to KEYMAP_END as a
+ * list of
+ *
+ *	<key> <len> <len bytes of runs>
+ *
+ * terminated by a 0xff key. The key is the CEC logical address of the
+ * source the map applies to, or KEYMAP_DEFAULT for the map every source
+ * falls back to.
+ *
+ * Each run covers n consecutive remote codes from <code>, sorted by code:
+ *
+ *	<code> <KEYMAP_RUN_LIST | n - 1> <n CEC keys, 0xff if unmapped>
+ *	<code> <KEYMAP_RUN_STEP | n - 1> <CEC key of the first, counting up>
+ *	<code> <KEYMAP_RUN_FILL | n - 1> <CEC key for all of them>
+ *
+ * Source maps only hold the codes that differ from the default map. A key
+ * of 0xff there unmaps the code for that source, and KEYMAP_INHERIT leaves
+ * it to the default map, which is how a list steps over codes it doesn't
+ * override. A press walks the current source's runs in the EEPROM, then
+ * the default map's if the source doesn't override the code, stopping at
+ * the first run past the code. That takes two EEPROM reads a run, and a
+ * run is at least three bytes, so no more than
+ * 2 * (KEYMAP_END - KEYMAP_ADDR) / 3 reads.
+ */
+#define KEYMAP_ADDR		0x10
+#define KEYMAP_DEFAULT		0x0f
+#define KEYMAP_INHERIT		0xfe
+
+/* The source snapshots in cec_tv.c take the rest of the EEPROM */
+#define KEYMAP_END		0xc8
+
+#define KEYMAP_RUN_LIST		0x00
+#define KEYMAP_RUN_STEP		0x80
+#define KEYMAP_RUN_FILL		0xc0
+#define KEYMAP_RUN_LEN		0x3f
+
+/*
+ * The keymap area can be read and written at runtime with vendor commands
+ * addressed to the TV:
+ *
+ *	<hdr> 0x89 KEYMAP_VC_READ <addr> <n> <crc16>
+ *	<hdr> 0x89 KEYMAP_VC_WRITE <addr> <n bytes> <crc16>
+ *
+ * Once the read is done or the bytes are in the EEPROM, the TV answers with
+ *
+ *	<hdr> 0x89 <cmd | KEYMAP_VC_REPLY> <status> <addr> <bytes read> <crc16>
+ *
+ * n is 1 to KEYMAP_VC_DATA and the range must lie within the keymap area.
+ * A write takes about 3.4 ms a byte, other frames sent to the TV meanwhile
+ * are nacked for their sender to retry.
+ * As with the bootloader, the CRC16 uses polynomial 0x8005 (reflected) and
+ * an initial value of 0xffff, covers the frame from the header on and is
+ * sent low byte first. A request with a bad CRC is answered with a feature
+ * abort like any other unknown vendor command.
+ */
+#define KEYMAP_VC_READ		0x4b
+#define KEYMAP_VC_WRITE		0x4c
+#define KEYMAP_VC_REPLY		0x80
+#define KEYMAP_VC_DATA		8
+
+#define KEYMAP_VC_OK		0x00
+#define KEYMAP_VC_RANGE		0x01
+#define KEYMAP_VC_BUSY		0x02
+
+#endif
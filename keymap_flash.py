@@ -0,0 +1,126 @@
+#!/usr/bin/python
+#
+# Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# CEC keymap programmer.
+#
+# Reads the keymap area of a running device with the vendor commands in
+# keymap.h, compares it with a keymap.bin from keymap_pack and writes only
+# the blocks that differ. The firmware keeps running and picks up the new
+# map as soon as the last write lands.
+
+import cec
+import sys
+import crcmod
+import struct
+
+crc16 = crcmod.mkCrcFun(0x18005, 0xffff)
+
+KEYMAP_ADDR = 0x10
+KEYMAP_END = 0xc8
+
+KEYMAP_VC_READ = 0x4b
+KEYMAP_VC_WRITE = 0x4c
+KEYMAP_VC_REPLY = 0x80
+KEYMAP_VC_DATA = 8
+
+KEYMAP_VC_OK = 0x00
+KEYMAP_VC_BUSY = 0x02
+
+class keymap_dev(cec.device):
+    def __init__(self, idx=0):
+        super(keymap_dev, self).__init__(idx)
+        self.logical_addresses(1 << 0xf)
+        self.read(timeout_ms=1)
+
+    def tx_done(self, status):
+        self.response = status
+
+    def receive_msg(self, msg, length, status):
+        msg = msg[:length]
+        if len(msg) < 7 or (ord(msg[0]) >> 4) != 0 or ord(msg[1]) != 0x89:
+            return
+        if crc16(msg):
+            return
+        self.reply = msg
+
+    def cmd(self, cmd, b):
+        b = struct.pack('<BBB', 0xf0, 0x89, cmd) + b
+        b += struct.pack('<H', crc16(b))
+
+        retries = 10
+        while retries:
+            retries -= 1
+            self.reply = None
+            self.response = None
+            self.write(b)
+            while self.response is None:
+                self.read()
+            if not self.response:
+                continue
+
+            # Writes take a few ms per byte before the answer comes
+            for i in range(20):
+                if self.reply is not None:
+                    break
+                self.read(timeout_ms=50)
+
+            r = self.reply
+            if r is None or ord(r[2]) != cmd | KEYMAP_VC_REPLY:
+                continue
+            status = ord(r[3])
+            if status == KEYMAP_VC_BUSY:
+                continue
+            if status != KEYMAP_VC_OK:
+                raise Exception('Keymap command 0x%02x failed: %d' % (cmd, status))
+            return r[5:-2]
+
+        raise Exception('No answer to keymap command 0x%02x' % cmd)
+
+    def read_block(self, addr, n):
+        return self.cmd(KEYMAP_VC_READ, struct.pack('<BB', addr, n))
+
+    def write_block(self, addr, b):
+        self.cmd(KEYMAP_VC_WRITE, struct.pack('<B', addr) + b)
+
+want = open(sys.argv[1], 'rb').read()
+if len(want) > KEYMAP_END - KEYMAP_ADDR:
+    raise Exception('Keymap too large')
+want += '\xff' * (KEYMAP_END - KEYMAP_ADDR - len(want))
+
+dev = keymap_dev()
+
+blocks = []
+for addr in range(KEYMAP_ADDR, KEYMAP_END, KEYMAP_VC_DATA):
+    have = dev.read_block(addr, KEYMAP_VC_DATA)
+    new = want[addr - KEYMAP_ADDR:addr - KEYMAP_ADDR + KEYMAP_VC_DATA]
+    if have == new:
+        continue
+
+    # Trim to the bytes that changed
+    start = 0
+    while have[start] == new[start]:
+        start += 1
+    end = len(new)
+    while have[end - 1] == new[end - 1]:
+        end -= 1
+    blocks.append((addr + start, new[start:end]))
+
+# Last block first, so the head of the map list changes last
+for addr, b in reversed(blocks):
+    dev.write_block(addr, b)
+
+print 'Wrote %d bytes in %d blocks' % (sum(len(b) for a, b in blocks), len(blocks))
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Packs the tables in lg_cec_keymap.c into the EEPROM format described in
+ * keymap.h. Built natively: keymap.hex comes from its output, and the host
+ * build uses keymap_pack() to fill the simulated EEPROM.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "keymap.h"
+
+extern const unsigned char cec_keymap[0xf0];
+extern const unsigned char cec_keymap_src[][3];
+extern const unsigned char cec_keymap_src_nr;
+
+/* Length of the run of codes from i that step by step, 1 if none */
+static int keymap_run(const unsigned char *map, int i, int step, int none)
+{
+	int n = 1;
+
+	while (i + n < 0xff && n <= KEYMAP_RUN_LEN && map[i + n] != none &&
+			map[i + n] == (unsigned char) (map[i] + n * step))
+		n++;
+
+	return n;
+}
+
+/*
+ * Encode map (0x100 entries, none where the map has no key) as runs,
+ * returns the length
+ */
+static int keymap_pack_runs(const unsigned char *map, unsigned char *out,
+								int none)
+{
+	unsigned char *start = out;
+	int i = 0;
+	int n;
+	int end;
+
+	while (i < 0xff) {
+		if (map[i] == none) {
+			i++;
+			continue;
+		}
+
+		/* Three or more keys counting up or all the same */
+		if ((n = keymap_run(map, i, 1, none)) >= 3) {
+			*out++ = i;
+			*out++ = KEYMAP_RUN_STEP | (n - 1);
+			*out++ = map[i];
+			i += n;
+			continue;
+		}
+		if ((n = keymap_run(map, i, 0, none)) >= 3) {
+			*out++ = i;
+			*out++ = KEYMAP_RUN_FILL | (n - 1);
+			*out++ = map[i];
+			i += n;
+			continue;
+		}
+
+		/*
+		 * List the keys up to the next run, bridging gaps of up to two
+		 * codes as that is no larger than starting a new list.
+		 */
+		end = i + 1;
+		for (n = i + 1; n < 0xff && n - i <= KEYMAP_RUN_LEN; n++) {
+			if (map[n] == none) {
+				if (n - end >= 2)
+					break;
+				continue;
+			}
+			if (keymap_run(map, n, 1, none) >= 3 ||
+					keymap_run(map, n, 0, none) >= 3)
+				break;
+			end = n + 1;
+		}
+
+		*out++ = i;
+		*out++ = KEYMAP_RUN_LIST | (end - i - 1);
+		memcpy(out, map + i, end - i);
+		out += end - i;
+		i = end;
+	}
+
+	return out - start;
+}
+
+/* Fill buf (the EEPROM from KEYMAP_ADDR on), returns the bytes used or -1 */
+int keymap_pack(unsigned char *buf, int size)
+{
+	unsigned char map[0x100];
+	unsigned char runs[0x200];
+	unsigned char addr;
+	int none;
+	int pos = 0;
+	int len;
+	int i;
+
+	memset(buf, 0xff, size);
+
+	for (addr = 0; addr <= KEYMAP_DEFAULT; addr++) {
+		none = addr == KEYMAP_DEFAULT ? 0xff : KEYMAP_INHERIT;
+		memset(map, none, sizeof(map));
+		if (addr == KEYMAP_DEFAULT)
+			memcpy(map, cec_keymap, sizeof(cec_keymap));
+
+		for (i = 0; i < cec_keymap_src_nr; i++)
+			if (cec_keymap_src[i][0] == addr)
+				map[cec_keymap_src[i][1]] = cec_keymap_src[i][2];
+
+		len = keymap_pack_runs(map, runs, none);
+		if (!len)
+			continue;
+		if (len > 0xff || pos + 2 + len > size) {
+			fprintf(stderr, "keymap doesn't fit in %d bytes\n", size);
+			return -1;
+		}
+
+		buf[pos++] = addr;
+		buf[pos++] = len;
+		memcpy(buf + pos, runs, len);
+		pos += len;
+	}
+
+	return pos;
+}
+
+#ifdef KEYMAP_PACK_MAIN
+int main(void)
+{
+	unsigned char buf[KEYMAP_END - KEYMAP_ADDR];
+	int len;
+
+	len = keymap_pack(buf, sizeof(buf));
+	if (len < 0)
+		return 1;
+	fprintf(stderr, "keymap: %d of %zu bytes\n", len, sizeof(buf));
+
+	fwrite(buf, sizeof(buf), 1, stdout);
+	return 0;
+}
+#endif
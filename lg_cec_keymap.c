@@ -128,3 +128,25 @@ PROGMEM const unsigned char cec_keymap[0xf0] = {
 	[KEY_MC_EJECT] =	CEC_KEY_EJECT,
 	[KEY_SAP] =		CEC_KEY_ENTER,
 };
+
+/*
+ * Keys that differ from cec_keymap for particular sources, as
+ * { logical address, remote code, CEC key }.
+ */
+PROGMEM const unsigned char cec_keymap_src[][3] = {
+	/*
+	 * Playback 2, usually the Blu-ray player. CEC has F1 blue, F2 red,
+	 * F3 green and F4 yellow, which disc menus follow.
+	 */
+	{ 8, KEY_F1,		CEC_KEY_F2 },
+	{ 8, KEY_RED2,		CEC_KEY_F2 },
+	{ 8, KEY_F2,		CEC_KEY_F3 },
+	{ 8, KEY_GREEN2,	CEC_KEY_F3 },
+	{ 8, KEY_F3,		CEC_KEY_F4 },
+	{ 8, KEY_YELLOW2,	CEC_KEY_F4 },
+	{ 8, KEY_F4,		CEC_KEY_F1 },
+	{ 8, KEY_BLUE2,		CEC_KEY_F1 },
+};
+
+const unsigned char cec_keymap_src_nr =
+				sizeof(cec_keymap_src) / sizeof(cec_keymap_src[0]);
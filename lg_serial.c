@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Parser for replies on the LG RS-232 port:
+ *
+ * [Command2][ ][Set ID][ ][OK][Data][x]
+ * [Command2][ ][Set ID][ ][NG][Data][x]
+ *
+ * m 01 OK00x
+ * b 01 OK90x
+ * m 01 NGx
+ *
+ * Set ID and data are hex, data may be any number of digit pairs or none.
+ * Each state expects one class of character and moves on to the next, the
+ * transitions are in lg_parse[]. Anything unexpected drops the reply.
+ */
+
+#include <avr/pgmspace.h>
+
+#include "lg_serial.h"
+
+/* Command2 bytes of the replies we keep state for, by enum lg_cmd */
+static const char lg_cmds[LG_NR_CMDS] PROGMEM = {
+	[LG_CMD_POWER] = 'a',
+	[LG_CMD_INPUT] = 'b',
+	[LG_CMD_MUTE] = 'e',
+	[LG_CMD_VOLUME] = 'f',
+	[LG_CMD_PICTURE] = 'x',
+};
+
+enum lg_char_class {
+	LG_ANY,
+	LG_SPACE,
+	LG_HEX,
+	LG_STATUS,
+};
+
+enum lg_parse_state {
+	LG_PARSE_CMD,
+	LG_PARSE_SP1,
+	LG_PARSE_ID_HI,
+	LG_PARSE_ID_LO,
+	LG_PARSE_SP2,
+	LG_PARSE_STATUS1,
+	LG_PARSE_STATUS2,
+	LG_PARSE_DATA_HI,
+	LG_PARSE_DATA_LO,
+	LG_PARSE_ERROR,
+};
+
+/* What each state expects, and where it goes next */
+static const unsigned char lg_parse[][2] PROGMEM = {
+	[LG_PARSE_CMD] =	{ LG_ANY,	LG_PARSE_SP1 },
+	[LG_PARSE_SP1] =	{ LG_SPACE,	LG_PARSE_ID_HI },
+	[LG_PARSE_ID_HI] =	{ LG_HEX,	LG_PARSE_ID_LO },
+	[LG_PARSE_ID_LO] =	{ LG_HEX,	LG_PARSE_SP2 },
+	[LG_PARSE_SP2] =	{ LG_SPACE,	LG_PARSE_STATUS1 },
+	[LG_PARSE_STATUS1] =	{ LG_STATUS,	LG_PARSE_STATUS2 },
+	[LG_PARSE_STATUS2] =	{ LG_STATUS,	LG_PARSE_DATA_HI },
+	/* Or the closing 'x', checked first */
+	[LG_PARSE_DATA_HI] =	{ LG_HEX,	LG_PARSE_DATA_LO },
+	[LG_PARSE_DATA_LO] =	{ LG_HEX,	LG_PARSE_DATA_HI },
+};
+
+struct lg_resp lg_resp;
+struct lg_state lg_state[LG_NR_CMDS];
+
+static unsigned char lg_parse_state;
+static unsigned char lg_nibble;
+static unsigned char lg_status1;
+
+static unsigned char lg_hex(unsigned char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return 0xff;
+}
+
+/* Start looking for a new reply */
+LG_SERIAL_PUBLIC void lg_serial_reset(void)
+{
+	lg_parse_state = LG_PARSE_CMD;
+}
+
+/* Our idea of this command's state is stale */
+LG_SERIAL_PUBLIC void lg_serial_forget(unsigned char cmd)
+{
+	lg_state[cmd].status = LG_NONE;
+}
+
+static void lg_serial_done(void)
+{
+	unsigned char i;
+
+	for (i = 0; i < LG_NR_CMDS; i++) {
+		if (pgm_read_byte(lg_cmds + i) == lg_resp.cmd) {
+			lg_state[i].status = lg_resp.status;
+			if (lg_resp.status == LG_OK && lg_resp.len)
+				lg_state[i].value = lg_resp.data[0];
+			break;
+		}
+	}
+}
+
+/* Feed a byte from the TV, returns an enum lg_rx */
+LG_SERIAL_PUBLIC unsigned char lg_serial_rx(unsigned char byte)
+{
+	unsigned char state = lg_parse_state;
+	unsigned char nibble;
+	bool match;
+
+	/* The data field may end after any whole byte */
+	if (byte == 'x' && state == LG_PARSE_DATA_HI) {
+		lg_parse_state = LG_PARSE_CMD;
+		lg_serial_done();
+		return LG_RX_DONE;
+	}
+
+	if (state == LG_PARSE_ERROR) {
+		/* Resync on the end of the broken reply */
+		if (byte == 'x')
+			lg_parse_state = LG_PARSE_CMD;
+		return LG_RX_NONE;
+	}
+
+	nibble = lg_hex(byte);
+
+	switch (pgm_read_byte(&lg_parse[state][0])) {
+	case LG_SPACE:
+		match = byte == ' ';
+		break;
+	case LG_HEX:
+		match = nibble < 0x10;
+		break;
+	case LG_STATUS:
+		match = byte >= 'A' && byte <= 'Z';
+		break;
+	default:
+		match = true;
+	}
+
+	if (!match) {
+		lg_parse_state = byte == 'x' ? LG_PARSE_CMD : LG_PARSE_ERROR;
+		return LG_RX_NONE;
+	}
+
+	switch (state) {
+	case LG_PARSE_CMD:
+		lg_resp.cmd = byte;
+		lg_resp.len = 0;
+		break;
+
+	case LG_PARSE_ID_HI:
+	case LG_PARSE_DATA_HI:
+		lg_nibble = nibble << 4;
+		break;
+
+	case LG_PARSE_ID_LO:
+		lg_resp.set_id = lg_nibble | nibble;
+		break;
+
+	case LG_PARSE_STATUS1:
+		lg_status1 = byte;
+		break;
+
+	case LG_PARSE_STATUS2:
+		if (lg_status1 == 'O' && byte == 'K')
+			lg_resp.status = LG_OK;
+		else if (lg_status1 == 'N' && byte == 'G')
+			lg_resp.status = LG_NG;
+		else {
+			lg_parse_state = LG_PARSE_ERROR;
+			return LG_RX_NONE;
+		}
+		break;
+
+	case LG_PARSE_DATA_LO:
+		/* Keep the first LG_DATA_MAX bytes, hand over all of them */
+		lg_resp.byte = lg_nibble | nibble;
+		if (lg_resp.len < LG_DATA_MAX)
+			lg_resp.data[lg_resp.len] = lg_resp.byte;
+		if (lg_resp.len != 0xff)
+			lg_resp.len++;
+		lg_parse_state = LG_PARSE_DATA_HI;
+		return LG_RX_DATA;
+	}
+
+	lg_parse_state = pgm_read_byte(&lg_parse[state][1]);
+	return LG_RX_NONE;
+}
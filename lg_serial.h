@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LG_SERIAL_H_
+#define _LG_SERIAL_H_
+
+#include <stdbool.h>
+
+#ifndef LG_SERIAL_PUBLIC
+#define LG_SERIAL_PUBLIC
+#endif
+
+/*
+ * Most data bytes kept from a single reply. RAM is too short to keep a
+ * whole data field, so the rest are only handed to the caller as they are
+ * parsed, see lg_serial_rx().
+ */
+#ifndef LG_DATA_MAX
+#define LG_DATA_MAX	1
+#endif
+
+enum lg_status {
+	LG_NONE,
+	LG_OK,
+	LG_NG,
+};
+
+/*
+ * The last complete reply from the TV. It is parsed in place, so it has
+ * to be dealt with before the next byte goes to lg_serial_rx().
+ */
+struct lg_resp {
+	char cmd;
+	unsigned char set_id;
+	unsigned char status;
+	unsigned char len;
+	unsigned char data[LG_DATA_MAX];
+
+	/* The data byte lg_serial_rx() just returned LG_RX_DATA for */
+	unsigned char byte;
+};
+
+extern struct lg_resp lg_resp;
+
+/*
+ * Latest reply per tracked command (the reply's Command2 byte, see
+ * lg_cmds), status is LG_NONE until one arrives. value is the first data
+ * byte of an OK reply. Each costs two bytes of RAM.
+ */
+enum lg_cmd {
+	LG_CMD_POWER,		/* ka */
+	LG_CMD_INPUT,		/* xb */
+	LG_CMD_MUTE,		/* ke */
+	LG_CMD_VOLUME,		/* kf */
+	LG_CMD_PICTURE,		/* dx */
+	LG_NR_CMDS,
+};
+
+struct lg_state {
+	unsigned char status;
+	unsigned char value;
+};
+
+extern struct lg_state lg_state[LG_NR_CMDS];
+
+enum lg_rx {
+	LG_RX_NONE,
+
+	/* Another data byte is in lg_resp.byte, lg_resp.len counts it */
+	LG_RX_DATA,
+
+	/* lg_resp holds a complete reply */
+	LG_RX_DONE,
+};
+
+LG_SERIAL_PUBLIC unsigned char lg_serial_rx(unsigned char byte);
+LG_SERIAL_PUBLIC void lg_serial_reset(void);
+LG_SERIAL_PUBLIC void lg_serial_forget(unsigned char cmd);
+
+#endif
@@ -16,6 +16,7 @@
  */
 
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 
 #include <util/delay.h>
 
@@ -29,49 +30,89 @@
 
 #include "usi_uart.h"
 
-#include "avr-cec/cec_spec.h"
-#include "avr-cec/time.h"
+#include "cec_spec.h"
+#include "time.h"
 
-#include "avr-cec/cec.c"
+#include "cec.c"
+#include "timer.c"
 #include "ir_nec.c"
+#include "lg_serial.c"
+#include "diag.c"
 #include "cec_tv.c"
 #include "usi_uart.c"
 #include "osccal.c"
 
+#ifndef CEC_PCINT
+/* Only here to wake us from sleep on CEC bus edges */
+EMPTY_INTERRUPT(PCINT0_vect);
+#endif
+
 int main(void) __attribute__((OS_main));
 int main(void)
 {
-	unsigned int last_j_short = 0;
+	unsigned long last_j = 0;
 	unsigned char last_j_long = 0;
+	bool busy;
 
 	load_osccal();
 
 	usi_uart_init();
 	ir_nec_init();
 	cec_init();
+	cec_tv_init();
+
+#ifndef CEC_PCINT
+	PCMSK |= _BV(CEC_PBIN);
+	GIMSK |= _BV(PCIE);
+#endif
+	set_sleep_mode(SLEEP_MODE_IDLE);
 
 	sei();
 
 	for (;;) {
-		__uint24 j;
+		unsigned long j;
+		unsigned long delta;
 		unsigned int delta_short;
 		unsigned char delta_long;
 		unsigned char j_long;
 
-		/* Assumes less than ~32ms has passed, can glitch otherwise */
-		j = jiffies();
+		j = jiffies32();
+		DIAG_TRACE_TIME(j);
 
-		delta_short = ((unsigned int) j) - last_j_short;
-		last_j_short = j;
+		/* Saturate rather than wrap if we were held off a long time */
+		delta = j - last_j;
+		last_j = j;
+		delta_short = delta > 0xffff ? 0xffff : delta;
 
 		cec_periodic(delta_short);
+		DIAG_CEC_RX(j);
+		DIAG_LOOP(delta_short);
 
 		j_long = j >> LJIFFIES_SHIFT;
 		delta_long = j_long - last_j_long;
 		last_j_long = j_long;
 
-		cec_tv_periodic(delta_long);
+		busy = cec_tv_periodic(delta_long);
 		ir_nec_periodic(delta_long);
+		DIAG_PERIODIC();
+
+		/*
+		 * Nothing left to do, sleep until the next USI overflow, IR
+		 * edge or CEC edge. Stay awake while our own frame is on the
+		 * bus or the line is held low, the driver may need to ack.
+		 * sleep_cpu() runs before any interrupt let in by sei().
+		 */
+		cli();
+		if (!busy && transmit_state < TRANSMIT_PEND &&
+				ser_rx_head == ser_rx_tail && !ir_nec_events &&
+				ir_nec_edge_head == ir_nec_edge_tail &&
+				!cec_receive_buf[0] && bit_is_set(CEC_PIN, CEC_PBIN)) {
+			sleep_enable();
+			sei();
+			sleep_cpu();
+			sleep_disable();
+		}
+		sei();
 	}
 
 	return 0;
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Deadline timers in ljiffies. Each timer stores the 16 bit time it
+ * expires at, so a timer can run for up to 0x7fff ljiffies. timer_advance()
+ * only compares the current time against the nearest deadline. Timers are
+ * only scanned when that deadline passes.
+ *
+ * A timer set for n ticks is running until more than n ticks have passed,
+ * the same as counting a signed value down until it goes negative.
+ */
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+#include "timer.h"
+
+static unsigned int timer_now;
+static unsigned int timer_deadline[TIMER_NR];
+static unsigned int timer_nearest;
+static unsigned char timer_active;
+
+TIMER_PUBLIC void timer_set(unsigned char n, unsigned int ticks)
+{
+	unsigned int deadline = timer_now + ticks;
+
+	timer_deadline[n] = deadline;
+	if (!timer_active || (signed int) (deadline - timer_nearest) < 0)
+		timer_nearest = deadline;
+	timer_active |= _BV(n);
+}
+
+/* A cancelled timer reads as expired but never calls back */
+TIMER_PUBLIC void timer_cancel(unsigned char n)
+{
+	timer_active &= ~_BV(n);
+}
+
+TIMER_PUBLIC bool timer_running(unsigned char n)
+{
+	return timer_active & _BV(n);
+}
+
+/* Free running count of ljiffies */
+TIMER_PUBLIC unsigned int timer_ticks(void)
+{
+	return timer_now;
+}
+
+TIMER_PUBLIC void timer_advance(unsigned char delta_long)
+{
+	unsigned char i;
+	unsigned char mask;
+	unsigned char expired = 0;
+	timer_cb_t cb;
+
+	timer_now += delta_long;
+
+	if (!timer_active || (signed int) (timer_now - timer_nearest) <= 0)
+		return;
+
+	/* Retire what expired and find the new nearest deadline */
+	for (i = 0, mask = 1; i < TIMER_NR; i++, mask <<= 1) {
+		if (!(timer_active & mask))
+			continue;
+		if ((signed int) (timer_now - timer_deadline[i]) > 0)
+			expired |= mask;
+		else if (!(timer_active & ~expired & (mask - 1)) ||
+			(signed int) (timer_deadline[i] - timer_nearest) < 0)
+			timer_nearest = timer_deadline[i];
+	}
+	timer_active &= ~expired;
+
+	/* Callbacks may set timers again */
+	for (i = 0, mask = 1; expired; i++, mask <<= 1) {
+		if (!(expired & mask))
+			continue;
+		expired &= ~mask;
+		cb = pgm_read_ptr(&timer_callbacks[i]);
+		if (cb)
+			cb();
+	}
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2016 Russ Dill <russ.dill@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stdbool.h>
+#include <avr/pgmspace.h>
+
+#ifndef TIMER_PUBLIC
+#define TIMER_PUBLIC
+#endif
+
+/* Number of timers, one bit each in timer_active */
+#define TIMER_NR	8
+
+/*
+ * Called from timer_advance() once a timer expires, or NULL. Indexed by
+ * timer number, provided by the user of the timers.
+ */
+typedef void (*timer_cb_t)(void);
+extern const timer_cb_t timer_callbacks[TIMER_NR] PROGMEM;
+
+TIMER_PUBLIC void timer_set(unsigned char n, unsigned int ticks);
+TIMER_PUBLIC void timer_cancel(unsigned char n);
+TIMER_PUBLIC bool timer_running(unsigned char n);
+TIMER_PUBLIC void timer_advance(unsigned char delta_long);
+TIMER_PUBLIC unsigned int timer_ticks(void);
+
+#endif
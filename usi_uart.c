@@ -29,15 +29,46 @@
 #define TCNT_TOT	HZ_TO_JIFFIES_RND(BAUD * 4)
 #define TCNT_TOP	(TCNT_TOT - 1)
 
-extern bool ser_overflow;
-volatile unsigned char send_buf[25];
+volatile unsigned char send_buf[USI_UART_TX_SIZE];
 volatile unsigned char send_prod;
 
-USI_UART_PUBLIC void usi_uart_put(char c)
+/* Room left in the transmit ring */
+USI_UART_PUBLIC unsigned char usi_uart_tx_free(void)
 {
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		send_buf[send_prod++] = c;
-	}
+	return (send_consumer - send_prod - 1) & (USI_UART_TX_SIZE - 1);
+}
+
+/* Queue a byte, returns false and drops it if the ring is full */
+USI_UART_PUBLIC bool usi_uart_put(char c)
+{
+	unsigned char prod = send_prod;
+	unsigned char next = (prod + 1) & (USI_UART_TX_SIZE - 1);
+
+	if (next == send_consumer)
+		return false;
+
+	send_buf[prod] = c;
+	send_prod = next;
+	return true;
+}
+
+/* Next received byte, or -1 if there isn't one. No locking needed. */
+USI_UART_PUBLIC int usi_uart_getc(void)
+{
+	unsigned char tail = ser_rx_tail;
+	unsigned char c;
+
+	if (tail == ser_rx_head)
+		return -1;
+
+	c = ser_rx_buf[tail];
+	ser_rx_tail = (tail + 1) & (USI_UART_RX_SIZE - 1);
+	return c;
+}
+
+USI_UART_PUBLIC unsigned char __attribute__ ((unused)) usi_uart_rx_count(void)
+{
+	return (ser_rx_head - ser_rx_tail) & (USI_UART_RX_SIZE - 1);
 }
 
 USI_UART_PUBLIC void __attribute__ ((noinline)) usi_uart_num(unsigned char c)
@@ -48,19 +79,23 @@ USI_UART_PUBLIC void __attribute__ ((noinline)) usi_uart_num(unsigned char c)
 	usi_uart_put(c);
 }
 
+/* Queue all of str or none of it, returns the number of bytes queued */
 USI_UART_PUBLIC unsigned char __attribute__ ((unused)) usi_uart_write_P(const char *str, unsigned char len)
 {
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		memcpy_P((void *) send_buf + send_prod, str, len);
-		send_prod += len;
-	}
+	unsigned char i;
+
+	if (usi_uart_tx_free() < len)
+		return 0;
+
+	for (i = 0; i < len; i++)
+		usi_uart_put(pgm_read_byte(str + i));
 
 	return len;
 }
 
-USI_UART_PUBLIC bool usi_uart_write_empty(void)
+USI_UART_PUBLIC bool __attribute__ ((unused)) usi_uart_write_empty(void)
 {
-	return send_prod == 0;
+	return send_prod == send_consumer;
 }
 
 USI_UART_PUBLIC void usi_uart_init(void)
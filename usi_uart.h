@@ -18,6 +18,21 @@
 #ifndef _USI_UART_H_
 #define _USI_UART_H_
 
+/* Receive ring size, a power of 2. Holds one less byte than this. */
+#ifndef USI_UART_RX_SIZE
+#define USI_UART_RX_SIZE	8
+#endif
+
+/*
+ * Transmit ring size, a power of 2. Holds one less byte than this, which
+ * is enough for the longest LG command line.
+ */
+#ifndef USI_UART_TX_SIZE
+#define USI_UART_TX_SIZE	16
+#endif
+
+#ifndef __ASSEMBLER__
+
 #include <stdbool.h>
 
 #ifndef USI_UART_PUBLIC
@@ -25,15 +40,48 @@
 #endif
 
 USI_UART_PUBLIC void usi_uart_num(unsigned char c);
-USI_UART_PUBLIC void usi_uart_put(char c);
+USI_UART_PUBLIC bool usi_uart_put(char c);
 USI_UART_PUBLIC unsigned char usi_uart_write_P(const char *str, unsigned char len);
 USI_UART_PUBLIC bool usi_uart_write_empty(void);
+USI_UART_PUBLIC unsigned char usi_uart_tx_free(void);
+
+USI_UART_PUBLIC int usi_uart_getc(void);
+USI_UART_PUBLIC unsigned char usi_uart_rx_count(void);
 
 USI_UART_PUBLIC void usi_uart_init(void);
 
+/*
+ * Timebase kept by __vector_14, in Timer0 ticks. jiffies32() is monotonic
+ * and wraps after about 35 minutes, jiffies16() is its low 16 bits and
+ * ljiffies() counts long jiffies (1 << LJIFFIES_SHIFT ticks).
+ */
+unsigned long jiffies32(void);
+unsigned int jiffies16(void);
+unsigned int ljiffies(void);
 
-extern unsigned char ser_recv_byte;
-extern bool ser_recv_ready;
+
+/*
+ * Transmit ring, drained by __vector_14. Only the main loop writes
+ * send_prod and only the ISR writes send_consumer.
+ */
+extern volatile unsigned char send_buf[USI_UART_TX_SIZE];
+extern volatile unsigned char send_prod;
+extern volatile unsigned char send_consumer;
+
+/*
+ * Receive ring, filled by __vector_14. Only the ISR writes ser_rx_head and
+ * only the main loop writes ser_rx_tail. Bytes that arrive with the ring
+ * full are counted in ser_rx_overrun.
+ */
+extern volatile unsigned char ser_rx_buf[USI_UART_RX_SIZE];
+extern volatile unsigned char ser_rx_head;
+extern volatile unsigned char ser_rx_tail;
+extern volatile unsigned char ser_rx_overrun;
+
+/* Set by __vector_14 when it ran too late and the USI counter wrapped */
+extern bool ser_overflow;
+
+#endif
 
 #endif
 